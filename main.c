@@ -1,10 +1,18 @@
 // main.c - WordStar 4.0 Clone for Windows Console
 #include <windows.h>
+#include <process.h>
+#include <io.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
 
 // Constants
 #define VERSION "4.0"
@@ -18,8 +26,57 @@
 #define EDIT_END (SCREEN_HEIGHT - 2)
 #define TAB_WIDTH 8
 #define MAX_MARKERS 10
+#define MAX_BUFFERS 64
+#define COMPACT_BUFFERS 8             // Compact inactive buffers beyond this many
+#define MAX_PANES 3
+#define MIN_PANE_ROWS 3
+#define MAX_WORKERS 16
+#define INPUT_BATCH 256               // Console events read per call
+#define PASTE_MIN_CHARS 32            // Typed characters in one read that count as a paste
+#define FRAME_RATE 60                 // Default cap on screen redraws per second
+#define JOURNAL_EXT ".wsj"            // Edit journal kept next to the file
+#define JOURNAL_SYNC_MS 1000          // Longest a journaled edit waits for fsync
+#define SAVE_EXT ".$$$"               // Temporary file a save writes before replacing
+#define SAVE_BUFFER (1 << 20)         // Output buffer of the save writer
+#define SAVE_POLL_MS 50               // How often the idle loop checks on saves
+#define COLD_AGE 60                   // Seconds unused before text is compressed
+#define COLD_MIN_AGE 5                // Seconds unused before it may be, over budget
+#define COLD_PASS_MS 5000             // How often the idle loop compresses text
+#define COLD_SLICE_LINES 16384        // Most lines one idle tick looks at
+#define COLD_SLICE_MS 50              // Time between the slices of one pass
+#define COLD_CHUNK_LINES 512          // Most lines compressed together
+#define COLD_CHUNK_BYTES 65536        // Most text compressed together
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define VIEW_AUTO_SIZE (1LL << 31)    // Files this big are paged from disk, not loaded
+#define VIEW_INDEX_STEP 1024          // Lines between line starts the index keeps
+#define VIEW_INDEX_SHIFT 16           // Index entries per block, as a power of 2
+#define VIEW_INDEX_BLOCKS 65536
+#define VIEW_WINDOW_LINES 65536       // Most lines of a paged file resident at once
+#define VIEW_WINDOW_BYTES (16 << 20)  // Text read for them, unless lines are longer
+#define VIEW_MIN_LINES 64             // Fewest a window holds short of the end: two screens
+#define VIEW_MARGIN 1024              // Lines from a window edge that slide the window
+#define VIEW_SCAN_BYTES (1 << 20)     // Reads while indexing and searching
+#define INDEX_EXT ".wsx"              // Line index kept next to a paged file
+#define INDEX_MIN_SIZE (64LL << 20)   // Smallest paged file worth keeping one for
+#define INDEX_SAMPLE 4096             // Bytes at each end of the file it checks
+#define FOLLOW_POLL_MS 250            // How often followed files are checked for growth
+#define FOLLOW_READ_BYTES (16 << 20)  // Most growth taken in per check
+#define DISK_CHECK_MS 1000            // How often the file being edited is checked for changes
+#define DIFF_MAX_COST 256             // Steps a diff searches for the best split before settling
+#define PARALLEL_MIN_JOBS 64          // Below this, run reform jobs on the UI thread
 #define FIND_BUFFER_SIZE 80
 #define REPLACE_BUFFER_SIZE 80
+#define LINE_ORDER_GAP (1ULL << 24)   // Spacing of line order keys on append
+#define LINE_ORDER_MIN_STEP 64ULL     // Densest spacing accepted after a relabel
+#define COL_MARK_SHIFT 6              // Column checkpoint every 64 bytes
+#define ATTR_NORMAL (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
+#define ATTR_BLOCK (BACKGROUND_BLUE | FOREGROUND_INTENSITY | \
+                    FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
+#define ATTR_DIFF (BACKGROUND_RED | FOREGROUND_INTENSITY | \
+                   FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
+#define DIFF_LINE 1                   // Compare mark: the line differs
+#define DIFF_GAP 2                    // Compare mark: the other side has lines here
 
 // Key codes
 #define CTRL_A 0x01
@@ -59,19 +116,172 @@ typedef enum {
     STATE_FIND,
     STATE_REPLACE,
     STATE_GOTO_LINE,
-    STATE_SAVE_AS
+    STATE_WRITE_BLOCK,
+    STATE_READ_FILE,
+    STATE_OPEN_FILE,
+    STATE_PICK_BUFFER,
+    STATE_MACRO_COUNT,
+    STATE_COMPARE,
+    STATE_SAVE_AS,
+    STATE_CONFIRM     // Waiting for Y or N
 } EditorState;
 
+// Questions answered with Y or N
+typedef enum {
+    CONFIRM_RELOAD,
+    CONFIRM_OVERWRITE,
+    CONFIRM_EXIT      // Overwrite, then close the buffer (^KX)
+} Confirm;
+
+// Why a batch script stopped working on its file
+typedef enum {
+    QUIT_NONE,
+    QUIT_EXIT,     // ^KX: saved, or tried to
+    QUIT_ABANDON   // ^KQ: edits given up
+} Quit;
+
+struct SaveJob;
+struct ColdChunk;
+
 // Text line structure
 typedef struct Line {
-    char *text;
+    char *text;       // NULL while the text is compressed in cold
     int length;
-    int capacity;
+    int capacity;     // While cold: the line's slot in its chunk
+    unsigned long long order;  // Increases down the document; compares positions
+    // Soft-wrap cache: row start offsets after the first, valid for wrap_width.
+    // It and col_marks are filled in lazily, on the UI thread only: reform
+    // workers and background saves read nothing of a line but its text
+    int wrap_width;
+    int wrap_rows;
+    int *wrap_breaks;
+    // Display column at the first character boundary from every 64th
+    // byte, as (byte, column) pairs, valid for tab width col_tab;
+    // NULL when each byte is one column
+    int col_tab;
+    int *col_marks;
+    int ascii;  // 1 if every byte is ASCII, 0 if not, -1 until checked
+    struct SaveJob *save;  // Save still writing this text; copy it before a change
+    struct ColdChunk *cold;  // Chunk holding the text compressed, or NULL
+    unsigned used;    // Second it was last shown or changed
+    unsigned char diff;  // Compare marks (DIFF_LINE, DIFF_GAP)
     struct Line *next;
     struct Line *prev;
 } Line;
 
-// Document structure
+// Position anchor: a place in the text that edits keep valid
+typedef struct {
+    Line *line;  // NULL when unset
+    int col;
+} Anchor;
+
+// Text encodings a file can be read from and written back to
+typedef enum {
+    ENC_UTF8,
+    ENC_UTF16LE,
+    ENC_UTF16BE,
+    ENC_ANSI     // Windows-1252, for files that are not valid UTF-8
+} Encoding;
+
+// How a file is stored on disk, kept from load so save writes it back
+typedef struct {
+    Encoding encoding;
+    int bom;              // Starts with a byte order mark
+    const char *newline;  // "\r\n", "\n" or "\r"
+    int final_newline;    // Last line is terminated too
+} FileFormat;
+
+// Block marking
+typedef struct {
+    Anchor start;
+    Anchor end;
+    int active;
+    int column_mode;  // For column blocks
+} Block;
+
+// Write-ahead journal of a document's edits since it was last saved. The
+// UI thread collects records in buf and hands them over at the end of each
+// input batch; a writer thread appends them to the file and syncs it.
+typedef struct {
+    char path[MAX_PATH];
+    FILE *fp;
+    char *buf;            // Records not yet handed over (UI thread only)
+    int len;
+    int cap;
+    int last_text;        // Offset of a trailing text record in buf, or -1
+    int last_text_line;
+    CRITICAL_SECTION lock;
+    char *pending;        // Records waiting for the writer
+    int pending_len;
+    int pending_cap;
+    HANDLE wake;
+    HANDLE thread;
+    volatile LONG stop;
+    long written;         // Bytes handed to the writer, header included
+} Journal;
+
+// A line's text as a save found it: at text, or compressed in a chunk
+typedef struct {
+    const char *text;
+    int length;
+    struct ColdChunk *cold;
+    int offset;       // Where the text is in the unpacked chunk
+} SaveText;
+
+// A save running in the background. It writes a snapshot of the lines'
+// text taken when it started; lines share their text with the snapshot
+// until they are next changed, when line_own() gives them a copy and the
+// shared text is retired here, to be freed once the save is done.
+typedef struct SaveJob {
+    char filename[MAX_PATH];
+    char temp[MAX_PATH];
+    FileFormat file;
+    SaveText *lines;
+    int count;
+    char **retired;
+    int retired_count;
+    int retired_cap;
+    unsigned long changes;  // Document's edit count at the snapshot
+    long journal_mark;      // Journal bytes up to the snapshot, -1 if none
+    int lost;               // Results, once the writer is done
+    int failed;
+    HANDLE thread;
+} SaveJob;
+
+// A file too big to hold, paged from disk and read-only. A scanner thread
+// records where every VIEW_INDEX_STEP-th line starts; only a window of
+// lines around the cursor is resident, as the document's lines.
+typedef struct {
+    char path[MAX_PATH];
+    FILE *fp;             // UI thread's handle on the file
+    long long size;
+    long long mtime;
+    long long data_start; // Past any byte order mark
+    Encoding encoding;    // As found in the first window read
+    int decoded;
+    // Start of line k * VIEW_INDEX_STEP, in blocks that never move
+    long long *index[VIEW_INDEX_BLOCKS];
+    long long indexed;    // Entries the scanner has published
+    long long lines;      // Lines in the file, once scanned
+    volatile LONG scanned;
+    // Once followed: line breaks in the file, and where the last one ends
+    long long breaks;
+    long long tail;
+    int counted;
+    CRITICAL_SECTION lock;
+    HANDLE thread;
+    volatile LONG stop;
+    // The resident window: its first line (from 0) and the bytes it holds
+    long long base;
+    long long start;
+    long long end;
+    // A jump waiting for the scanner to index its line, or -1, and its column
+    long long pending;
+    int pending_col;
+} FileView;
+
+// Document structure: one open file with its own cursor, block, markers
+// and the view it was last shown in
 typedef struct {
     Line *first_line;
     Line *current_line;
@@ -79,20 +289,60 @@ typedef struct {
     int line_count;
     int modified;
     char filename[MAX_PATH];
+    FileFormat file;
+    long long disk_size;  // File as last loaded or saved, -1 if none
+    long long disk_time;
+    unsigned long long disk_sample;  // Hash of its first and last 4 KB
+    Journal *journal;     // Open once edited since the last save
+    int journal_failed;   // Journal file couldn't be created
+    SaveJob *save;        // Background save in progress
+    FileView *view;       // Paged from disk and read-only, or NULL
+    int follow;           // Taking in what is appended to the file (^QT)
+    long long follow_held;  // Bytes at its end not taken in yet (a partial line)
+    HANDLE watch;         // Change notification on its folder while followed, or NULL
+    long long asked_size; // Change on disk last asked about, so it is asked once
+    long long asked_time;
+    unsigned long long asked_sample;
+    int compared;         // Lines carry compare marks to show (^OD)
+    unsigned long changes;  // Edits made, to tell which ones a save has
+    // Compressed text: totals over the chunks, and the last one unpacked
+    int cold_chunks;
+    long long cold_raw;
+    long long cold_packed;
+    struct ColdChunk *peek_chunk;
+    char *peek_buf;
+    int peek_cap;
+    Anchor cool_at;       // Where the compression pass goes on, if part way
+    Block block;
     // Place markers
-    Line *markers[MAX_MARKERS];
-    int marker_x[MAX_MARKERS];
+    Anchor markers[MAX_MARKERS];
+    // Anchors adjusted by every edit (the cursor is adjusted separately)
+    Anchor **anchors;
+    int anchor_count;
+    int anchor_cap;
+    // Last resolved line number, so lookups walk only from there
+    Line *hint_line;
+    int hint_row;
+    // Screen position while another buffer is shown
+    int top_line;
+    int top_sub;
+    int screen_col;
 } Document;
 
-// Block marking
-typedef struct {
-    Line *start_line;
-    Line *end_line;
-    int start_col;
-    int end_col;
-    int active;
-    int column_mode;  // For column blocks
-} Block;
+// Text of a run of lines that went unused for a while, compressed. The
+// lines keep their place in the document with no text of their own; the
+// first use of any of them unpacks the whole chunk back into them.
+typedef struct ColdChunk {
+    Document *doc;
+    char *packed;
+    int packed_len;
+    int raw_len;      // Unpacked: each line's text and terminator in turn
+    Line **lines;     // The lines, by slot; NULL once freed
+    int *offsets;     // Where each slot's text starts when unpacked
+    int count;
+    int live;         // Lines still cold
+    int refs;         // Snapshot lines of saves still writing from it
+} ColdChunk;
 
 // Find/Replace
 typedef struct {
@@ -116,15 +366,69 @@ typedef struct {
     int line_spacing;
 } Format;
 
+// A position carried through a paragraph reflow, tracked by how much
+// non-blank text precedes it
+typedef struct {
+    Anchor pos;
+    long ink;
+} ReflowMark;
+
+// Two runs of line hashes being compared, and the furthest each diagonal
+// x - y has got searching forward from their starts and back from their
+// ends
+typedef struct {
+    const unsigned long long *a;
+    const unsigned long long *b;
+    char *a_changed;
+    char *b_changed;
+    int *fd;
+    int *bd;
+} DiffRun;
+
+// A window onto a document. The active pane's cursor and view live in the
+// document and the editor; the others keep theirs in anchors registered
+// with their document, so edits made through another pane keep them on
+// the same text.
+typedef struct {
+    Document *doc;
+    Anchor cursor;
+    Anchor top;       // First line shown
+    int top_sub;
+    int screen_col;
+    int first_row;    // Screen rows the pane covers
+    int rows;
+} Pane;
+
+// What a text row of the screen last showed, so rows that come out the
+// same are not written to the console again
+typedef struct {
+    int valid;
+    int units;
+    int from;         // Highlighted columns
+    int to;
+    int diff;         // Compare marks shown
+    WCHAR text[SCREEN_WIDTH * 5];
+} ScreenRow;
+
 // Editor structure
 typedef struct {
-    Document doc;
-    Block block;
+    Document *doc;                  // Buffer being edited
+    Document *docs[MAX_BUFFERS];    // Open buffers, in the order opened
+    int doc_count;
     FindReplace find;
     Format format;
     EditorState state;
+    Confirm confirm;  // Question asked in STATE_CONFIRM
     int top_line;
+    int top_sub;      // Screen rows of the top line scrolled off (soft wrap)
     int screen_col;
+    int soft_wrap;    // Wrap long lines on screen without splitting them
+    int view_top;     // Screen rows of the active pane
+    int view_rows;
+    Pane panes[MAX_PANES];
+    int pane_count;
+    int pane;         // Active pane
+    ScreenRow shadow[SCREEN_HEIGHT];
     HANDLE hConsoleIn;
     HANDLE hConsoleOut;
     CONSOLE_SCREEN_BUFFER_INFO csbi;
@@ -134,14 +438,35 @@ typedef struct {
     int insert_mode;
     int show_ruler;
     int auto_indent;
+    WCHAR high_surrogate;  // Pending first half of a typed surrogate pair
+    DWORD frame_ms;        // Minimum time between redraws, 0 for no cap
+    // Keystroke macro
+    KEY_EVENT_RECORD *macro;
+    int macro_len;
+    int macro_cap;
+    int recording;
+    int playing;
+    int batch;        // Running a script without a console
+    int journal_off;  // Edits aren't journaled (batch runs, loading, recovery)
+    Quit quit;        // Script asked to leave
+    int saving;       // Background saves in progress
+    long long cold_budget;  // Text memory to keep to by compressing, 0 = off
+    int cool_doc;           // Document the compression pass is in
+    long long cool_counted; // Text memory the pass has seen so far
+    long long cool_resident;  // Text memory the last whole pass saw, less what was freed
+    int view_files;   // Page files from disk whatever their size (-v)
     // Clipboard for block operations
     Line *clipboard;
     int clipboard_lines;
+    int clipboard_column;  // Clipboard holds column slices, not a text range
 } Editor;
 
 // Function prototypes
 void init_editor(Editor *ed);
 void cleanup_editor(Editor *ed);
+void free_editor(Editor *ed);
+int parse_script(const char *text, long len, KEY_EVENT_RECORD **keys);
+int run_batch(const char *script, int file_count, char **filenames);
 void init_console(Editor *ed);
 void restore_console(Editor *ed);
 void draw_screen(Editor *ed);
@@ -151,16 +476,52 @@ void draw_menu_line(Editor *ed);
 void draw_text_area(Editor *ed);
 void set_cursor_pos(Editor *ed, int x, int y);
 void write_at(Editor *ed, int x, int y, const char *text, WORD attr);
+char key_char(KEY_EVENT_RECORD *key);
 void process_key(Editor *ed, KEY_EVENT_RECORD *key);
+void record_key(Editor *ed, KEY_EVENT_RECORD *key);
+void toggle_recording(Editor *ed);
+void unrecord_chord(Editor *ed);
+void play_macro(Editor *ed, int times);
 void handle_normal_key(Editor *ed, KEY_EVENT_RECORD *key);
 void handle_ctrl_k(Editor *ed, KEY_EVENT_RECORD *key);
 void handle_ctrl_q(Editor *ed, KEY_EVENT_RECORD *key);
 void handle_ctrl_o(Editor *ed, KEY_EVENT_RECORD *key);
 void handle_ctrl_p(Editor *ed, KEY_EVENT_RECORD *key);
 void handle_input_state(Editor *ed, KEY_EVENT_RECORD *key);
+Line *alloc_line(int capacity);
 Line *create_line(void);
+Line *create_line_text(const char *text, int len);
+void line_changed(Editor *ed, Line *line);
+int ascii_span(const char *s, int n);
+int utf8_decode(const char *s, int n, unsigned *cp);
+int utf8_encode(unsigned cp, char *buf);
+int utf8_check(const char *s, int n);
+int char_width(unsigned cp);
+int line_is_ascii(Line *line);
+int text_width(const char *text, int n);
+int line_char(Line *line, int x, unsigned *cp);
+int char_start(Line *line, int x);
+int next_char(Line *line, int x);
+int prev_char(Line *line, int x);
+int line_col(Editor *ed, Line *line, int x);
+int line_byte_at_col(Editor *ed, Line *line, int col);
+void line_reserve(Line *line, int len);
+void line_own(Line *line);
 void free_line(Line *line);
+void assign_line_order(Line *first, Line *last, int count);
+void link_lines(Editor *ed, Line *prev, Line *first, Line *last, int count);
+void unlink_lines(Editor *ed, Line *first, Line *last, int count);
+void register_anchor(Document *doc, Anchor *anchor);
+void unregister_anchor(Document *doc, Anchor *anchor);
+void replace_anchor(Document *doc, Anchor *from, Anchor *to);
+void clear_anchors(Editor *ed);
+void adjust_anchors(Editor *ed, Line *line, int col, int removed, int inserted);
+void move_anchors(Editor *ed, Line *from, int col, Line *to, int to_col);
+void drop_anchors(Editor *ed, Line *first, Line *last, Line *dest, int dest_col);
 void insert_char(Editor *ed, char ch);
+void insert_codepoint(Editor *ed, unsigned cp);
+void insert_text(Editor *ed, const char *text, int len);
+void wrap_paragraph_tail(Editor *ed, Line *line);
 void delete_char(Editor *ed);
 void backspace_char(Editor *ed);
 void move_cursor_left(Editor *ed);
@@ -181,9 +542,94 @@ void delete_line(Editor *ed);
 void delete_word_right(Editor *ed);
 void delete_to_eol(Editor *ed);
 void new_line(Editor *ed);
+char *read_file_data(const char *filename, long *size);
+char *convert_to_utf8(const char *data, long size, Encoding encoding, long *len);
+Line *split_lines(const char *text, long len, FileFormat *ff, int *count, int *invalid);
+Line *decode_file(char *data, long size, FileFormat *ff, int *count);
+int write_encoded(FILE *fp, const FileFormat *ff, const char *text, int len);
+void write_bom(FILE *fp, const FileFormat *ff);
+const char *format_name(const FileFormat *ff, char *buf, int size);
 void save_file(Editor *ed);
+void start_save(Editor *ed);
+void finish_save(Editor *ed, Document *doc);
+int finish_saves(Editor *ed);
+void release_save(Document *doc);
+Document *create_document(void);
+void free_document(Document *doc);
+void compact_document(Document *doc);
+int lz_bound(int n);
+int lz_pack(const char *src, int n, char *dst);
+int lz_unpack(const char *src, int n, char *dst, int raw_len);
+void line_warm(Line *line);
+void warm_lines(Line *first, Line *last);
+const char *line_peek(Line *line);
+void freeze_lines(Document *doc, Line *first, int count, int raw_len);
+void thaw_chunk(ColdChunk *chunk);
+void drop_chunk(ColdChunk *chunk);
+int cool_documents(Editor *ed);
+void show_memory(Editor *ed);
+void show_document(Editor *ed, Document *doc);
+void switch_buffer(Editor *ed, int index);
+int buffer_index(Editor *ed);
+void open_buffer(Editor *ed, const char *filename);
+void close_buffer(Editor *ed, int abandon);
+void pick_buffer(Editor *ed);
+void layout_panes(Editor *ed);
+void deactivate_pane(Editor *ed);
+void activate_pane(Editor *ed, int index);
+void split_window(Editor *ed);
+void next_window(Editor *ed);
+void close_window(Editor *ed);
+void retarget_panes(Editor *ed, Document *from, Document *to);
+void draw_pane(Editor *ed, Pane *pane);
+void draw_divider(Editor *ed, int index);
+void draw_rows(Editor *ed, Line *line, int sub, int first, int rows);
+void put_row(Editor *ed, int y, const WCHAR *text, int units, int from, int to, int diff);
+void forget_rows(Editor *ed);
 void save_file_as(Editor *ed, const char *filename);
 void load_file(Editor *ed, const char *filename);
+void file_stamp(const char *filename, long long *size, long long *mtime);
+unsigned long long file_sample(const char *filename, long long size);
+void index_path(const char *filename, char *path);
+int open_view(Editor *ed, const char *filename);
+void close_view(Document *doc);
+void view_load(Editor *ed, long long base);
+void view_move(Editor *ed, long long base);
+int view_goto(Editor *ed, long long target);
+int view_defer(Editor *ed, long long line, int col);
+int view_jump(Editor *ed);
+void view_follow(Editor *ed);
+int view_find(Editor *ed, long long at, long long line, long long to, long long *found, int *col);
+int view_allows(Editor *ed, KEY_EVENT_RECORD *key);
+int views_scanning(Editor *ed);
+int can_follow(Document *doc);
+void set_follow(Document *doc, int on);
+void toggle_follow(Editor *ed);
+int follow_file(Editor *ed);
+int follow_files(Editor *ed);
+int files_followed(Editor *ed);
+int follow_handles(Editor *ed, HANDLE *handles, int room);
+unsigned long long line_hash(const char *text, int len);
+void diff_lines(const unsigned long long *a, int n, const unsigned long long *b, int m,
+                char *a_changed, char *b_changed);
+int disk_changed(Document *doc);
+int check_disk(Editor *ed);
+void reload_file(Editor *ed);
+void ask_confirm(Editor *ed, Confirm confirm, const char *question);
+int ask_overwrite(Editor *ed, Confirm confirm);
+void compare_with(Editor *ed, const char *name);
+void stop_compare(Editor *ed);
+void next_difference(Editor *ed, int back);
+void handle_confirm(Editor *ed, KEY_EVENT_RECORD *key);
+void journal_path(const char *filename, char *path);
+Journal *open_journal(Document *doc, long keep);
+void close_journal(Document *doc, int remove_file);
+void rebase_journal(Editor *ed, Document *doc, long mark);
+Journal *edit_journal(Editor *ed);
+void journal_text(Editor *ed, Line *line, int num);
+void journal_lines(Editor *ed, char op, int num, Line *first, int count);
+void commit_journals(Editor *ed);
+void recover_journal(Editor *ed);
 void mark_block_begin(Editor *ed);
 void mark_block_end(Editor *ed);
 void copy_block(Editor *ed);
@@ -193,31 +639,66 @@ void write_block(Editor *ed, const char *filename);
 void read_block(Editor *ed, const char *filename);
 void hide_block(Editor *ed);
 int is_line_in_block(Editor *ed, Line *line);
+int block_span(Editor *ed, Line *line, int *from, int *to);
+int get_block_bounds(Editor *ed, Line **l1, int *c1, Line **l2, int *c2);
+void toggle_column_mode(Editor *ed);
 void update_status(Editor *ed, const char *msg);
 void find_text(Editor *ed);
 void find_next(Editor *ed);
 void replace_text(Editor *ed);
-void goto_line(Editor *ed, int line_num);
+void goto_line(Editor *ed, long long line_num);
 void set_marker(Editor *ed, int marker);
 void goto_marker(Editor *ed, int marker);
 void reform_paragraph(Editor *ed);
+Line *reflow_lines(const Format *fmt, Line *start, Line *end,
+                   ReflowMark *marks, int mark_count, int *count);
+void replace_lines(Editor *ed, Line *start, Line *end, Line *lines, int count);
+int collect_reflow_marks(Editor *ed, Line *first, Line *last, ReflowMark *marks,
+                         Anchor **owners, Anchor *cursor);
+void reform_document(Editor *ed);
+void run_jobs(int jobs, int min_parallel, void (*fn)(void *ctx, int job), void *ctx);
 void center_line(Editor *ed);
 int get_line_number(Editor *ed, Line *line);
+Line *get_line_at(Editor *ed, int num);
+int wrap_width(Editor *ed);
+int wrap_rows(Editor *ed, Line *line);
+int wrap_row_start(Line *line, int row);
+int wrap_row_of(Editor *ed, Line *line, int x);
+void move_visual_row(Editor *ed, int dir);
+void shift_top(Editor *ed, int rows);
+int cursor_screen_row(Editor *ed);
+void scroll_to_cursor(Editor *ed);
+void toggle_soft_wrap(Editor *ed);
+void draw_text_row(Editor *ed, int y, Line *line, int start, int end);
 void clear_clipboard(Editor *ed);
 Line *duplicate_lines(Line *start, Line *end, int *count);
 void delete_lines(Editor *ed, Line *start, Line *end);
 void insert_lines(Editor *ed, Line *lines, int count);
+int pos_before(Line *l1, int c1, Line *l2, int c2);
+Line *copy_range(Line *l1, int c1, Line *l2, int c2, int *count);
+Line *copy_columns(Line *l1, Line *l2, int c1, int c2, int *count);
+void delete_range(Editor *ed, Line *l1, int c1, Line *l2, int c2);
+void delete_columns(Editor *ed, Line *l1, Line *l2, int c1, int c2);
+void insert_range(Editor *ed, Line *at, int col, Line *chain, int count);
+void insert_columns(Editor *ed, Line *at, int col, Line *chain);
+void paste_clipboard(Editor *ed);
+void replace_range(Editor *ed, Line *l1, int c1, Line *l2, int c2,
+                   const char *text, int len, Line **end_line, int *end_col);
+void insert_string(Editor *ed, Line *line, int col, const char *text, int len,
+                   Line **end_line, int *end_col);
+int paste_burst(Editor *ed, INPUT_RECORD *inputs, int count);
 
 // Initialize editor
 void init_editor(Editor *ed) {
     memset(ed, 0, sizeof(Editor));
-    ed->doc.first_line = create_line();
-    ed->doc.current_line = ed->doc.first_line;
-    ed->doc.line_count = 1;
+    ed->doc = create_document();
+    ed->docs[ed->doc_count++] = ed->doc;
     ed->insert_mode = 1;
     ed->show_ruler = 1;
     ed->state = STATE_NORMAL;
-    strcpy(ed->doc.filename, "UNTITLED.TXT");
+    ed->pane_count = 1;
+    ed->frame_ms = 1000 / FRAME_RATE;
+    layout_panes(ed);
     
     // Initialize format settings
     ed->format.right_margin = 65;
@@ -227,14 +708,46 @@ void init_editor(Editor *ed) {
     ed->format.word_wrap = 1;
     ed->format.justify = 0;
     ed->format.line_spacing = 1;
+}
+
+// Create an empty, untitled document
+Document *create_document(void) {
+    Document *doc = (Document *)calloc(1, sizeof(Document));
     
-    // Initialize markers
+    doc->first_line = create_line();
+    doc->first_line->order = LINE_ORDER_GAP;
+    doc->current_line = doc->first_line;
+    doc->line_count = 1;
+    strcpy(doc->filename, "UNTITLED.TXT");
+    doc->file.newline = "\r\n";
+    doc->disk_size = -1;
+    
+    // Register everything that points into the text
     for (int i = 0; i < MAX_MARKERS; i++) {
-        ed->doc.markers[i] = NULL;
-        ed->doc.marker_x[i] = 0;
+        register_anchor(doc, &doc->markers[i]);
     }
+    register_anchor(doc, &doc->block.start);
+    register_anchor(doc, &doc->block.end);
+    register_anchor(doc, &doc->cool_at);
+    return doc;
+}
+
+// Free a document and all of its text
+void free_document(Document *doc) {
+    release_save(doc);
+    close_journal(doc, 0);
+    set_follow(doc, 0);
+    close_view(doc);
     
-    init_console(ed);
+    Line *line = doc->first_line;
+    while (line) {
+        Line *next = line->next;
+        free_line(line);
+        line = next;
+    }
+    free(doc->peek_buf);
+    free(doc->anchors);
+    free(doc);
 }
 
 // Initialize console
@@ -258,6 +771,7 @@ void init_console(Editor *ed) {
     
     // Clear screen
     system("cls");
+    forget_rows(ed);
     
     // Show cursor
     CONSOLE_CURSOR_INFO cursorInfo;
@@ -276,26 +790,565 @@ void restore_console(Editor *ed) {
     set_cursor_pos(ed, 0, 0);
 }
 
-// Create new line
-Line *create_line(void) {
+// Allocate an unlinked, empty line with room for capacity bytes
+Line *alloc_line(int capacity) {
     Line *line = (Line *)malloc(sizeof(Line));
-    line->capacity = 256;
+    line->capacity = capacity;
     line->text = (char *)malloc(line->capacity);
     line->text[0] = '\0';
     line->length = 0;
+    line->order = 0;
+    line->wrap_width = 0;
+    line->wrap_rows = 1;
+    line->wrap_breaks = NULL;
+    line->col_tab = 0;
+    line->col_marks = NULL;
+    line->ascii = -1;
+    line->save = NULL;
+    line->cold = NULL;
+    line->used = 0;
+    line->diff = 0;
     line->next = NULL;
     line->prev = NULL;
     return line;
 }
 
+// Create new line
+Line *create_line(void) {
+    return alloc_line(256);
+}
+
+// Create a line holding a copy of text, sized to fit
+Line *create_line_text(const char *text, int len) {
+    Line *line = alloc_line(len + 1);
+    memcpy(line->text, text, len);
+    line->text[len] = '\0';
+    line->length = len;
+    return line;
+}
+
+// Drop cached layout after a line's text changed, and journal the new text
+void line_changed(Editor *ed, Line *line) {
+    ed->doc->changes++;
+    line->used = GetTickCount() / 1000;
+    line->wrap_width = 0;
+    line->col_tab = 0;
+    line->ascii = -1;
+    journal_text(ed, line, 0);
+}
+
+// Length of the run of ASCII bytes at the start of s, checking 16 bytes
+// at a time where SSE2 is available
+int ascii_span(const char *s, int n) {
+    int i = 0;
+#ifdef HAVE_SSE2
+    while (i + 16 <= n && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) {
+        i += 16;
+    }
+#endif
+    while (i < n && !(s[i] & 0x80)) i++;
+    return i;
+}
+
+// Decode the UTF-8 sequence at the start of s (n bytes available). Returns
+// its length and stores the code point, or returns 0 if the bytes are not
+// well-formed UTF-8 (overlong forms and surrogates included).
+int utf8_decode(const char *s, int n, unsigned *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    unsigned c = u[0];
+    unsigned min;
+    int len;
+    
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2; c &= 0x1F; min = 0x80;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3; c &= 0x0F; min = 0x800;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4; c &= 0x07; min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (n < len) return 0;
+    
+    for (int i = 1; i < len; i++) {
+        if ((u[i] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (u[i] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0;
+    *cp = c;
+    return len;
+}
+
+// Encode a code point as UTF-8 into buf, returning the length
+int utf8_encode(unsigned cp, char *buf) {
+    if (cp < 0x80) {
+        buf[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    buf[0] = (char)(0xF0 | (cp >> 18));
+    buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    buf[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// Offset of the first byte of s that is not well-formed UTF-8, or n.
+// ASCII runs are skipped in bulk, so plain text costs one fast scan.
+int utf8_check(const char *s, int n) {
+    int i = 0;
+    unsigned cp;
+    
+    while (i < n) {
+        i += ascii_span(s + i, n - i);
+        if (i >= n) break;
+        int len = utf8_decode(s + i, n - i, &cp);
+        if (!len) return i;
+        i += len;
+    }
+    return n;
+}
+
+// Screen columns taken by a code point: 0 for combining marks and other
+// zero-width characters, 2 for East Asian wide characters and emoji
+int char_width(unsigned cp) {
+    static const unsigned zero[][2] = {
+        {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+        {0x064B, 0x065F}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+        {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x20D0, 0x20FF},
+        {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xE0100, 0xE01EF}
+    };
+    static const unsigned wide[][2] = {
+        {0x1100, 0x115F}, {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF},
+        {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+        {0xFE30, 0xFE4F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x1F300, 0x1F64F},
+        {0x1F900, 0x1F9FF}, {0x20000, 0x3FFFD}
+    };
+    
+    if (cp < 0x300) return 1;
+    for (int i = 0; i < (int)(sizeof(zero) / sizeof(zero[0])); i++) {
+        if (cp >= zero[i][0] && cp <= zero[i][1]) return 0;
+    }
+    for (int i = 0; i < (int)(sizeof(wide) / sizeof(wide[0])); i++) {
+        if (cp >= wide[i][0] && cp <= wide[i][1]) return 2;
+    }
+    return 1;
+}
+
+// Whether a line is plain ASCII, checked once per edit
+int line_is_ascii(Line *line) {
+    line_warm(line);
+    if (line->ascii < 0) line->ascii = ascii_span(line->text, line->length) == line->length;
+    return line->ascii;
+}
+
+// Display width of n bytes of text without tabs
+int text_width(const char *text, int n) {
+    int i = ascii_span(text, n);
+    int cols = i;
+    
+    while (i < n) {
+        unsigned cp;
+        int len = utf8_decode(&text[i], n - i, &cp);
+        if (!len) {
+            len = 1;
+            cp = 0xFFFD;
+        }
+        cols += char_width(cp);
+        i += len;
+    }
+    return cols;
+}
+
+// Code point at byte x of a line and its length in bytes. A byte that is
+// not part of well-formed UTF-8 stands alone as U+FFFD.
+int line_char(Line *line, int x, unsigned *cp) {
+    line_warm(line);
+    int len = utf8_decode(&line->text[x], line->length - x, cp);
+    if (!len) {
+        *cp = 0xFFFD;
+        len = 1;
+    }
+    return len;
+}
+
+// Start of the UTF-8 character holding byte x, so byte-based column
+// slices never cut a character in two
+int char_start(Line *line, int x) {
+    int start = x;
+    line_warm(line);
+    while (start > 0 && start > x - 3 && start < line->length &&
+           (line->text[start] & 0xC0) == 0x80) {
+        start--;
+    }
+    unsigned cp;
+    return line_char(line, start, &cp) > x - start ? start : x;
+}
+
+// Cursor stop after byte x: past one character and any combining marks
+// that belong with it
+int next_char(Line *line, int x) {
+    unsigned cp;
+    
+    if (x >= line->length) return line->length;
+    if (line_is_ascii(line)) return x + 1;
+    
+    x += line_char(line, x, &cp);
+    while (x < line->length) {
+        int len = line_char(line, x, &cp);
+        if (char_width(cp) != 0) break;
+        x += len;
+    }
+    return x;
+}
+
+// Cursor stop before byte x, skipping back over combining marks to the
+// character they belong with
+int prev_char(Line *line, int x) {
+    unsigned cp;
+    
+    if (x <= 0) return 0;
+    if (line_is_ascii(line)) return x - 1;
+    
+    while (x > 0) {
+        // Start of the character that ends at x
+        int start = x - 1;
+        while (start > 0 && start > x - 4 && (line->text[start] & 0xC0) == 0x80) start--;
+        if (line_char(line, start, &cp) != x - start) {
+            start = x - 1;
+            line_char(line, start, &cp);
+        }
+        x = start;
+        if (char_width(cp) != 0) break;
+    }
+    return x;
+}
+
+// Display column reached after showing code point cp at column col
+static int advance_col(int col, unsigned cp, int tab_width) {
+    return cp == '\t' ? (col / tab_width + 1) * tab_width : col + char_width(cp);
+}
+
+// Rebuild a line's column checkpoints for the current tab width
+static void build_col_marks(Editor *ed, Line *line) {
+    int tab_width = ed->format.tab_width;
+    int marks = (line->length >> COL_MARK_SHIFT) + 1;
+    int next = 0;
+    int col = 0;
+    
+    line_warm(line);
+    free(line->col_marks);
+    line->col_marks = NULL;
+    line->col_tab = tab_width;
+    
+    if (line_is_ascii(line) && !memchr(line->text, '\t', line->length)) return;
+    
+    line->col_marks = (int *)malloc(2 * marks * sizeof(int));
+    for (int i = 0; ; ) {
+        while (next < marks && (next << COL_MARK_SHIFT) <= i) {
+            line->col_marks[2 * next] = i;
+            line->col_marks[2 * next + 1] = col;
+            next++;
+        }
+        if (i >= line->length) break;
+        
+        unsigned cp;
+        i += line_char(line, i, &cp);
+        col = advance_col(col, cp, tab_width);
+    }
+}
+
+// Display column of byte offset x, with tabs expanded and characters at
+// their screen width. Counts forward from the nearest cached checkpoint
+// instead of the start of the line.
+int line_col(Editor *ed, Line *line, int x) {
+    if (line->col_tab != ed->format.tab_width) build_col_marks(ed, line);
+    
+    if (x > line->length) return line_col(ed, line, line->length) + x - line->length;
+    if (!line->col_marks) return x;
+    
+    int mark = x >> COL_MARK_SHIFT;
+    if (line->col_marks[2 * mark] > x) mark--;
+    
+    int i = line->col_marks[2 * mark];
+    int col = line->col_marks[2 * mark + 1];
+    while (i < x) {
+        unsigned cp;
+        i += line_char(line, i, &cp);
+        col = advance_col(col, cp, ed->format.tab_width);
+    }
+    return col;
+}
+
+// Byte offset of the character shown at display column col (the end of
+// the line if col is past it)
+int line_byte_at_col(Editor *ed, Line *line, int col) {
+    if (line->col_tab != ed->format.tab_width) build_col_marks(ed, line);
+    
+    if (!line->col_marks) return col < line->length ? col : line->length;
+    
+    int lo = 0, hi = line->length >> COL_MARK_SHIFT;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (line->col_marks[2 * mid + 1] <= col) lo = mid; else hi = mid - 1;
+    }
+    
+    int i = line->col_marks[2 * lo];
+    int c = line->col_marks[2 * lo + 1];
+    while (i < line->length) {
+        unsigned cp;
+        int len = line_char(line, i, &cp);
+        int next = advance_col(c, cp, ed->format.tab_width);
+        if (next > col) break;
+        c = next;
+        i += len;
+    }
+    return i;
+}
+
+// Make room for len characters plus the terminator
+void line_reserve(Line *line, int len) {
+    line_own(line);
+    if (len >= line->capacity) {
+        int capacity = line->capacity * 2;
+        if (capacity <= len) capacity = len + 1;
+        line->capacity = capacity;
+        line->text = (char *)realloc(line->text, line->capacity);
+    }
+}
+
+// Keep text a save is writing until the save is done
+static void retire_text(SaveJob *job, char *text) {
+    if (job->retired_count == job->retired_cap) {
+        job->retired_cap = job->retired_cap ? job->retired_cap * 2 : 256;
+        job->retired = (char **)realloc(job->retired, job->retired_cap * sizeof(char *));
+    }
+    job->retired[job->retired_count++] = text;
+}
+
+// Give a line its own copy of text a save is still writing, before the
+// text is changed in place
+void line_own(Line *line) {
+    line_warm(line);
+    if (!line->save) return;
+    
+    char *text = (char *)malloc(line->capacity);
+    memcpy(text, line->text, line->length + 1);
+    retire_text(line->save, line->text);
+    line->text = text;
+    line->save = NULL;
+}
+
 // Free line
 void free_line(Line *line) {
     if (line) {
-        free(line->text);
+        if (line->cold) {
+            ColdChunk *chunk = line->cold;
+            chunk->lines[line->capacity] = NULL;
+            chunk->live--;
+            drop_chunk(chunk);
+        } else if (line->save) {
+            retire_text(line->save, line->text);
+        } else {
+            free(line->text);
+        }
+        free(line->wrap_breaks);
+        free(line->col_marks);
         free(line);
     }
 }
 
+// Give a freshly linked run of lines order keys between its neighbours.
+// When the gap is exhausted, the run is widened over following lines and
+// the whole window is respaced, so appends stay O(1) and relabels local.
+void assign_line_order(Line *first, Line *last, int count) {
+    unsigned long long lo = first->prev ? first->prev->order : 0;
+    Line *hi_line = last->next;
+    int n = count;
+    
+    while (hi_line && hi_line->order - lo <= (unsigned long long)(n + 1) * LINE_ORDER_MIN_STEP) {
+        hi_line = hi_line->next;
+        n++;
+    }
+    
+    unsigned long long hi = hi_line ? hi_line->order : lo + (unsigned long long)(n + 1) * LINE_ORDER_GAP;
+    unsigned long long step = (hi - lo) / (n + 1);
+    unsigned long long key = lo;
+    
+    for (Line *line = first; line != hi_line; line = line->next) {
+        key += step;
+        line->order = key;
+    }
+}
+
+// Link a chain of lines into the document after prev (NULL = at the top)
+void link_lines(Editor *ed, Line *prev, Line *first, Line *last, int count) {
+    Line *next = prev ? prev->next : ed->doc->first_line;
+    
+    first->prev = prev;
+    last->next = next;
+    if (prev) {
+        prev->next = first;
+    } else {
+        ed->doc->first_line = first;
+    }
+    if (next) {
+        next->prev = last;
+    }
+    
+    ed->doc->line_count += count;
+    ed->doc->changes++;
+    assign_line_order(first, last, count);
+    
+    if (ed->doc->hint_line && ed->doc->hint_line->order > last->order) {
+        ed->doc->hint_row += count;
+    }
+    
+    if (edit_journal(ed)) {
+        journal_lines(ed, 'I', prev ? get_line_number(ed, prev) : 0, first, count);
+    }
+}
+
+// Unlink a chain of lines from the document; the caller frees them.
+// Anchors and the cursor still on those lines drop to the start of the
+// following line (or the end of the preceding one).
+void unlink_lines(Editor *ed, Line *first, Line *last, int count) {
+    if (edit_journal(ed)) {
+        // Number from the line before, which stays a valid hint
+        journal_lines(ed, 'D', first->prev ? get_line_number(ed, first->prev) + 1 : 1, NULL, count);
+    }
+    
+    // Lines leaving the document stop sharing text with a save
+    if (ed->doc->save) {
+        for (Line *line = first; line != last->next; line = line->next) line_own(line);
+    }
+    ed->doc->changes++;
+    
+    Line *dest = last->next;
+    int dest_col = 0;
+    if (!dest) {
+        dest = first->prev;
+        dest_col = dest ? dest->length : 0;
+    }
+    drop_anchors(ed, first, last, dest, dest_col);
+    
+    Line *hint = ed->doc->hint_line;
+    if (hint && hint->order >= first->order) {
+        if (hint->order <= last->order) {
+            ed->doc->hint_line = NULL;
+        } else {
+            ed->doc->hint_row -= count;
+        }
+    }
+    
+    if (first->prev) {
+        first->prev->next = last->next;
+    } else {
+        ed->doc->first_line = last->next;
+    }
+    if (last->next) {
+        last->next->prev = first->prev;
+    }
+    
+    first->prev = NULL;
+    last->next = NULL;
+    ed->doc->line_count -= count;
+}
+
+// Register an anchor to be kept valid by edits
+void register_anchor(Document *doc, Anchor *anchor) {
+    if (doc->anchor_count == doc->anchor_cap) {
+        doc->anchor_cap = doc->anchor_cap ? doc->anchor_cap * 2 : 16;
+        doc->anchors = (Anchor **)realloc(doc->anchors, doc->anchor_cap * sizeof(Anchor *));
+    }
+    doc->anchors[doc->anchor_count++] = anchor;
+}
+
+// Stop adjusting an anchor
+void unregister_anchor(Document *doc, Anchor *anchor) {
+    for (int i = 0; i < doc->anchor_count; i++) {
+        if (doc->anchors[i] == anchor) {
+            doc->anchors[i] = doc->anchors[--doc->anchor_count];
+            return;
+        }
+    }
+}
+
+// Keep adjusting an anchor that was moved to another address
+void replace_anchor(Document *doc, Anchor *from, Anchor *to) {
+    for (int i = 0; i < doc->anchor_count; i++) {
+        if (doc->anchors[i] == from) doc->anchors[i] = to;
+    }
+}
+
+// Unset every anchor, e.g. when the whole text is replaced
+void clear_anchors(Editor *ed) {
+    for (int i = 0; i < ed->doc->anchor_count; i++) {
+        ed->doc->anchors[i]->line = NULL;
+        ed->doc->anchors[i]->col = 0;
+    }
+    ed->doc->hint_line = NULL;
+}
+
+// Shift anchors on a line after `removed` characters at col were replaced
+// by `inserted` ones; anchors inside the removed text collapse to col and
+// an anchor exactly at an insertion point stays before the new text
+void adjust_anchors(Editor *ed, Line *line, int col, int removed, int inserted) {
+    for (int i = 0; i < ed->doc->anchor_count; i++) {
+        Anchor *a = ed->doc->anchors[i];
+        if (a->line != line) continue;
+        
+        if (a->col >= col + removed && (removed > 0 || a->col > col)) {
+            a->col += inserted - removed;
+        } else if (a->col > col) {
+            a->col = col;
+        }
+    }
+}
+
+// Send anchors and the cursor on lines first..last to a single position
+void drop_anchors(Editor *ed, Line *first, Line *last, Line *dest, int dest_col) {
+    for (int i = 0; i < ed->doc->anchor_count; i++) {
+        Anchor *a = ed->doc->anchors[i];
+        if (a->line && a->line->order >= first->order && a->line->order <= last->order) {
+            a->line = dest;
+            a->col = dest_col;
+        }
+    }
+    
+    Line *cur = ed->doc->current_line;
+    if (cur->order >= first->order && cur->order <= last->order) {
+        ed->doc->current_line = dest;
+        ed->doc->cursor_x = dest_col;
+    }
+}
+
+// Move anchors at or after col on one line to another line, keeping their
+// offset from col (used when a line is split or joined)
+void move_anchors(Editor *ed, Line *from, int col, Line *to, int to_col) {
+    for (int i = 0; i < ed->doc->anchor_count; i++) {
+        Anchor *a = ed->doc->anchors[i];
+        if (a->line == from && a->col >= col) {
+            a->line = to;
+            a->col = to_col + a->col - col;
+        }
+    }
+}
+
 // Set cursor position
 void set_cursor_pos(Editor *ed, int x, int y) {
     COORD pos = {x, y};
@@ -321,40 +1374,50 @@ void write_at(Editor *ed, int x, int y, const char *text, WORD attr) {
 void draw_screen(Editor *ed) {
     draw_status_line(ed);
     if (ed->show_ruler) draw_ruler_line(ed);
+    for (int i = 0; i < ed->pane_count; i++) {
+        if (i != ed->pane) draw_pane(ed, &ed->panes[i]);
+        if (i + 1 < ed->pane_count) draw_divider(ed, i);
+    }
     draw_text_area(ed);
     draw_menu_line(ed);
     
     // Position cursor
-    int screen_y = 0;
-    Line *line = ed->doc.first_line;
-    for (int i = 0; i < ed->top_line && line; i++) {
-        line = line->next;
-    }
+    int screen_y = cursor_screen_row(ed);
     
-    Line *curr = line;
-    while (curr && curr != ed->doc.current_line && screen_y < (EDIT_END - EDIT_START)) {
-        curr = curr->next;
-        screen_y++;
-    }
-    
-    if (curr == ed->doc.current_line) {
-        set_cursor_pos(ed, ed->doc.cursor_x - ed->screen_col, EDIT_START + screen_y);
+    if (screen_y >= 0) {
+        Line *line = ed->doc->current_line;
+        int x = line_col(ed, line, ed->doc->cursor_x) - ed->screen_col;
+        if (ed->soft_wrap) {
+            int start = wrap_row_start(line, wrap_row_of(ed, line, ed->doc->cursor_x));
+            x = line_col(ed, line, ed->doc->cursor_x) - line_col(ed, line, start);
+        }
+        set_cursor_pos(ed, x, ed->view_top + screen_y);
     }
 }
 
 // Draw status line
 void draw_status_line(Editor *ed) {
     char status[SCREEN_WIDTH + 1];
-    int line_num = get_line_number(ed, ed->doc.current_line);
+    long long line_num = get_line_number(ed, ed->doc->current_line);
+    FileView *view = ed->doc->view;
     
-    snprintf(status, sizeof(status), " %s %s  Line %d Col %d  %s%s%s",
-             ed->doc.filename,
-             ed->doc.modified ? "*" : " ",
+    if (view) line_num += view->base;
+    
+    char buffer[16] = "";
+    
+    if (ed->doc_count > 1) snprintf(buffer, sizeof(buffer), "[%d/%d] ", buffer_index(ed) + 1, ed->doc_count);
+    snprintf(status, sizeof(status), " %s%s %s  Line %lld Col %d  %s%s%s%s%s%s%s",
+             buffer, ed->doc->filename,
+             ed->doc->modified ? "*" : " ",
              line_num,
-             ed->doc.cursor_x + 1,
+             line_col(ed, ed->doc->current_line, ed->doc->cursor_x) + 1,
              ed->insert_mode ? "Insert" : "Overtype",
              ed->format.word_wrap ? " Wrap" : "",
-             ed->block.active ? " Block" : "");
+             ed->doc->block.active ? (ed->doc->block.column_mode ? " Column" : " Block") : "",
+             ed->recording ? " Rec" : "",
+             ed->doc->save ? " Saving" : "",
+             view ? (view->scanned ? " View" : " Indexing") : "",
+             ed->doc->follow ? " Follow" : "");
     
     // Pad with spaces
     int len = strlen(status);
@@ -400,7 +1463,7 @@ void draw_menu_line(Editor *ed) {
     
     switch (ed->state) {
         case STATE_CTRL_K:
-            menu = " ^KB Begin ^KK End ^KC Copy ^KV Move ^KY Delete ^KW Write ^KR Read ^KH Hide ";
+            menu = " ^KB Begin ^KK End ^KC Copy ^KV Move ^KY Delete ^KW Write ^KE Edit ^KU Next ";
             break;
         case STATE_CTRL_Q:
             menu = " ^QF Find ^QA Replace ^QR BegFile ^QC EndFile ^QY DelEOL ^QL RestoreLine ";
@@ -420,9 +1483,24 @@ void draw_menu_line(Editor *ed) {
         case STATE_GOTO_LINE:
             menu = " Enter line number: ";
             break;
+        case STATE_WRITE_BLOCK:
+        case STATE_READ_FILE:
+        case STATE_OPEN_FILE:
         case STATE_SAVE_AS:
             menu = " Enter filename: ";
             break;
+        case STATE_PICK_BUFFER:
+            menu = ed->status_msg;
+            break;
+        case STATE_MACRO_COUNT:
+            menu = " Play macro how many times (Enter for once): ";
+            break;
+        case STATE_COMPARE:
+            menu = " Compare with buffer number or file (Enter for the file on disk): ";
+            break;
+        case STATE_CONFIRM:
+            menu = " Y Yes   Any other key No ";
+            break;
         default:
             menu = " ^J Help ^KD Save ^KX Exit ^QF Find ^KB Block ^OW Wrap ^B Reform ^N Insert ";
             break;
@@ -449,281 +1527,691 @@ void draw_menu_line(Editor *ed) {
     }
 }
 
-// Draw text area
+// Draw text area of the active pane
 void draw_text_area(Editor *ed) {
-    Line *line = ed->doc.first_line;
+    Line *top = ed->top_line < ed->doc->line_count ? get_line_at(ed, ed->top_line + 1) : NULL;
     
-    // Skip to top line
-    for (int i = 0; i < ed->top_line && line; i++) {
-        line = line->next;
+    if (top && ed->soft_wrap && ed->top_sub >= wrap_rows(ed, top)) {
+        ed->top_sub = wrap_rows(ed, top) - 1;
     }
+    draw_rows(ed, top, ed->top_sub, ed->view_top, ed->view_rows);
+}
+
+// Draw an inactive pane from its own top line, borrowing the editor's
+// document and scroll column while its rows are drawn
+void draw_pane(Editor *ed, Pane *pane) {
+    Document *doc = ed->doc;
+    int screen_col = ed->screen_col;
+    Line *top = pane->top.line ? pane->top.line : pane->doc->first_line;
+    int sub = pane->top_sub;
     
-    // Draw visible lines
-    for (int y = EDIT_START; y <= EDIT_END; y++) {
-        set_cursor_pos(ed, 0, y);
-        
-        if (line) {
-            // Check if line is in block
-            int in_block = is_line_in_block(ed, line);
-            WORD attr = in_block ? (BACKGROUND_BLUE | FOREGROUND_INTENSITY | 
-                                   FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE) : 0;
-            
-            // Draw line with horizontal scrolling
-            char display_line[SCREEN_WIDTH + 1];
-            int start = ed->screen_col;
-            
-            for (int i = 0; i < SCREEN_WIDTH; i++) {
-                if (start + i < line->length) {
-                    display_line[i] = line->text[start + i];
-                } else {
-                    display_line[i] = ' ';
-                }
-            }
-            display_line[SCREEN_WIDTH] = '\0';
+    ed->doc = pane->doc;
+    ed->screen_col = pane->screen_col;
+    if (ed->soft_wrap && sub >= wrap_rows(ed, top)) sub = wrap_rows(ed, top) - 1;
+    draw_rows(ed, top, sub, pane->first_row, pane->rows);
+    ed->doc = doc;
+    ed->screen_col = screen_col;
+}
+
+// Draw the bar under a pane, naming the file it shows
+void draw_divider(Editor *ed, int index) {
+    Pane *pane = &ed->panes[index];
+    Document *doc = index == ed->pane ? ed->doc : pane->doc;
+    WCHAR bar[SCREEN_WIDTH];
+    int units = 0;
+    
+    for (int i = 0; i < 3; i++) bar[units++] = L'-';
+    bar[units++] = L' ';
+    for (const char *c = doc->filename; *c && units < SCREEN_WIDTH - 1; c++) {
+        bar[units++] = (unsigned char)*c;
+    }
+    bar[units++] = L' ';
+    while (units < SCREEN_WIDTH) bar[units++] = L'-';
+    put_row(ed, pane->first_row + pane->rows, bar, units, 0, 0, 0);
+}
+
+// Draw rows of text starting at screen row first, from wrapped row sub of
+// line top (NULL past the end of the document)
+void draw_rows(Editor *ed, Line *line, int sub, int first, int rows) {
+    int row = ed->soft_wrap ? sub : 0;
+    
+    for (int y = first; y < first + rows; y++) {
+        if (line && ed->soft_wrap) {
+            // One screen row per wrapped piece of the line
+            int count = wrap_rows(ed, line);
+            int end = row + 1 < count ? wrap_row_start(line, row + 1) : line->length;
+            draw_text_row(ed, y, line, wrap_row_start(line, row), end);
             
-            if (attr) {
-                write_at(ed, 0, y, display_line, attr);
-            } else {
-                printf("%s", display_line);
+            if (++row >= count) {
+                line = line->next;
+                row = 0;
             }
-            
+        } else if (line) {
+            // Draw line with horizontal scrolling
+            draw_text_row(ed, y, line, line_byte_at_col(ed, line, ed->screen_col), line->length);
             line = line->next;
         } else {
             // Empty line
-            for (int i = 0; i < SCREEN_WIDTH; i++) {
-                putchar(' ');
-            }
+            WCHAR blank[SCREEN_WIDTH];
+            for (int i = 0; i < SCREEN_WIDTH; i++) blank[i] = L' ';
+            put_row(ed, y, blank, SCREEN_WIDTH, 0, 0, 0);
         }
     }
 }
 
-// Check if line is in block
-int is_line_in_block(Editor *ed, Line *line) {
-    if (!ed->block.active) return 0;
+// Show a row of text with columns from..to highlighted as the block and
+// any compare marks, writing to the console only if the row differs from
+// what it already shows
+void put_row(Editor *ed, int y, const WCHAR *text, int units, int from, int to, int diff) {
+    ScreenRow *row = &ed->shadow[y];
+    DWORD written;
     
-    Line *curr = ed->block.start_line;
-    while (curr) {
-        if (curr == line) return 1;
-        if (curr == ed->block.end_line) break;
-        curr = curr->next;
+    if (row->valid && row->units == units && row->from == from && row->to == to &&
+        row->diff == diff && memcmp(row->text, text, units * sizeof(WCHAR)) == 0) {
+        return;
     }
     
-    return 0;
-}
-
-// Get line number
-int get_line_number(Editor *ed, Line *target) {
-    int num = 1;
-    Line *line = ed->doc.first_line;
+    set_cursor_pos(ed, 0, y);
+    WriteConsoleW(ed->hConsoleOut, text, units, &written, NULL);
+    if (diff) {
+        // The whole row for a line that differs, the first column where
+        // the other side has lines this one lacks
+        WORD attrs[SCREEN_WIDTH];
+        COORD pos = {0, y};
+        int n = (diff & DIFF_LINE) ? SCREEN_WIDTH : 1;
+        for (int c = 0; c < n; c++) attrs[c] = ATTR_DIFF;
+        WriteConsoleOutputAttribute(ed->hConsoleOut, attrs, n, pos, &written);
+    }
+    if (from < to) {
+        WORD attrs[SCREEN_WIDTH];
+        COORD pos = {from, y};
+        for (int c = from; c < to; c++) attrs[c - from] = ATTR_BLOCK;
+        WriteConsoleOutputAttribute(ed->hConsoleOut, attrs, to - from, pos, &written);
+    }
     
-    while (line && line != target) {
-        line = line->next;
-        num++;
+    row->valid = 1;
+    row->units = units;
+    row->from = from;
+    row->to = to;
+    row->diff = diff;
+    memcpy(row->text, text, units * sizeof(WCHAR));
+}
+
+// Forget what the console shows, after it was cleared or resized, so the
+// next draw writes every row
+void forget_rows(Editor *ed) {
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        ed->shadow[y].valid = 0;
     }
+}
+
+// Draw the text of line from byte start up to (not including) byte end on
+// screen row y, expanding tabs and highlighting any part inside the block.
+// The row begins at display column screen_col, or at start when wrapping.
+// Text goes out as UTF-16 so the console shows every character, with
+// combining marks kept with the character before them.
+void draw_text_row(Editor *ed, int y, Line *line, int start, int end) {
+    WCHAR row[SCREEN_WIDTH * 5];  // Room for surrogates and combining marks
+    int units = 0;
+    line->used = GetTickCount() / 1000;
+    int origin = ed->soft_wrap ? line_col(ed, line, start) : ed->screen_col;
+    int col = line_col(ed, line, start);
     
-    return num;
+    for (int i = start; i < end && col - origin < SCREEN_WIDTH; ) {
+        unsigned cp;
+        i += line_char(line, i, &cp);
+        int next = advance_col(col, cp, ed->format.tab_width);
+        
+        if (cp == '\t' || col < origin || next - origin > SCREEN_WIDTH) {
+            // Blanks for a tab or a wide character cut by a screen edge
+            for (int c = col > origin ? col : origin; c < next && c - origin < SCREEN_WIDTH; c++) {
+                row[units++] = L' ';
+            }
+        } else if (next > col || units > 0) {
+            if (cp < 32 || cp == 127) cp = '?';
+            if (units + 2 > SCREEN_WIDTH * 4) break;
+            if (cp >= 0x10000) {
+                row[units++] = (WCHAR)(0xD800 + ((cp - 0x10000) >> 10));
+                row[units++] = (WCHAR)(0xDC00 + ((cp - 0x10000) & 0x3FF));
+            } else {
+                row[units++] = (WCHAR)cp;
+            }
+        }
+        col = next;
+    }
+    for (int c = col > origin ? col - origin : 0; c < SCREEN_WIDTH; c++) {
+        row[units++] = L' ';
+    }
+    
+    // Highlight only the block columns on this row
+    int from = 0, to = 0;
+    if (block_span(ed, line, &from, &to)) {
+        from = line_col(ed, line, from) - origin;
+        to = (to < 0) ? SCREEN_WIDTH : line_col(ed, line, to) - origin;
+        if (from < 0) from = 0;
+        if (to > SCREEN_WIDTH) to = SCREEN_WIDTH;
+    }
+    
+    // A gap mark shows on the first row of the line only
+    int diff = 0;
+    if (ed->doc->compared) {
+        diff = line->diff & (!ed->soft_wrap || start == 0 ? DIFF_LINE | DIFF_GAP : DIFF_LINE);
+    }
+    put_row(ed, y, row, units, from, to, diff);
 }
 
-// Insert character
-void insert_char(Editor *ed, char ch) {
-    Line *line = ed->doc.current_line;
+// Soft-wrap width: the right margin, kept on screen with room for the cursor
+int wrap_width(Editor *ed) {
+    int width = ed->format.right_margin;
+    if (width < 8) width = 8;
+    if (width > SCREEN_WIDTH - 1) width = SCREEN_WIDTH - 1;
+    return width;
+}
+
+// Number of screen rows a line takes when soft-wrapped. Break points are
+// cached on the line and only recomputed after an edit or margin change.
+int wrap_rows(Editor *ed, Line *line) {
+    int width = wrap_width(ed);
     
-    // Expand line if needed
-    if (line->length >= line->capacity - 1) {
-        line->capacity *= 2;
-        line->text = (char *)realloc(line->text, line->capacity);
+    if (line->wrap_width == width) return line->wrap_rows;
+    line_warm(line);
+    
+    int rows = 1;
+    int cap = 0;
+    int start = 0;
+    
+    free(line->wrap_breaks);
+    line->wrap_breaks = NULL;
+    
+    int end_col = line_col(ed, line, line->length);
+    
+    while (end_col - line_col(ed, line, start) > width) {
+        // Break after the last blank that fits, or mid-word if there is none
+        int limit = line_byte_at_col(ed, line, line_col(ed, line, start) + width);
+        if (limit <= start) limit = next_char(line, start);
+        int brk = limit;
+        while (brk > start && line->text[brk - 1] != ' ') brk--;
+        if (brk == start) brk = limit;
+        
+        if (rows - 1 == cap) {
+            cap = cap ? cap * 2 : 4;
+            line->wrap_breaks = (int *)realloc(line->wrap_breaks, cap * sizeof(int));
+        }
+        line->wrap_breaks[rows - 1] = brk;
+        rows++;
+        start = brk;
     }
     
-    if (ed->insert_mode) {
-        // Insert mode - shift characters right
-        memmove(&line->text[ed->doc.cursor_x + 1], &line->text[ed->doc.cursor_x], 
-                line->length - ed->doc.cursor_x + 1);
-        line->text[ed->doc.cursor_x] = ch;
-        line->length++;
+    line->wrap_rows = rows;
+    line->wrap_width = width;
+    return rows;
+}
+
+// Offset of the first character on a wrapped row (cache must be valid)
+int wrap_row_start(Line *line, int row) {
+    return row > 0 ? line->wrap_breaks[row - 1] : 0;
+}
+
+// Wrapped row of a line that holds column x
+int wrap_row_of(Editor *ed, Line *line, int x) {
+    int lo = 0, hi = wrap_rows(ed, line) - 1;
+    
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (line->wrap_breaks[mid - 1] <= x) lo = mid; else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Move the cursor one screen row up (dir < 0) or down through wrapped
+// lines, keeping its column within the row
+void move_visual_row(Editor *ed, int dir) {
+    Line *line = ed->doc->current_line;
+    int row = wrap_row_of(ed, line, ed->doc->cursor_x);
+    int goal = line_col(ed, line, ed->doc->cursor_x) - line_col(ed, line, wrap_row_start(line, row));
+    
+    if (dir < 0) {
+        if (row > 0) {
+            row--;
+        } else if (line->prev) {
+            line = line->prev;
+            row = wrap_rows(ed, line) - 1;
+        } else {
+            return;
+        }
     } else {
-        // Overwrite mode
-        if (ed->doc.cursor_x >= line->length) {
-            line->length = ed->doc.cursor_x + 1;
-            line->text[line->length] = '\0';
+        if (row + 1 < wrap_rows(ed, line)) {
+            row++;
+        } else if (line->next) {
+            line = line->next;
+            row = 0;
+        } else {
+            return;
         }
-        line->text[ed->doc.cursor_x] = ch;
     }
     
-    ed->doc.cursor_x++;
-    ed->doc.modified = 1;
+    int start = wrap_row_start(line, row);
+    int more_rows = row + 1 < wrap_rows(ed, line);
+    int end = more_rows ? prev_char(line, wrap_row_start(line, row + 1)) : line->length;
+    int x = line_byte_at_col(ed, line, line_col(ed, line, start) + goal);
+    
+    ed->doc->current_line = line;
+    ed->doc->cursor_x = x < end ? x : end;
+}
+
+// Scroll the top of the screen by a number of screen rows
+void shift_top(Editor *ed, int rows) {
+    Line *line = get_line_at(ed, ed->top_line + 1);
+    int wrap = ed->soft_wrap;
+    
+    for (; rows < 0; rows++) {
+        if (ed->top_sub > 0) {
+            ed->top_sub--;
+        } else if (line->prev) {
+            line = line->prev;
+            ed->top_line--;
+            ed->top_sub = wrap ? wrap_rows(ed, line) - 1 : 0;
+        } else {
+            break;
+        }
+    }
     
-    // Word wrap if enabled
-    if (ed->format.word_wrap && ed->doc.cursor_x > ed->format.right_margin) {
-        // Find last space before margin
-        int wrap_pos = ed->format.right_margin;
-        while (wrap_pos > ed->format.left_margin && line->text[wrap_pos] != ' ') {
-            wrap_pos--;
+    for (; rows > 0; rows--) {
+        if (wrap && ed->top_sub + 1 < wrap_rows(ed, line)) {
+            ed->top_sub++;
+        } else if (line->next) {
+            line = line->next;
+            ed->top_line++;
+            ed->top_sub = 0;
+        } else {
+            break;
         }
+    }
+}
+
+// Screen row of the cursor within the text area, or -1 if off screen.
+// Only the rows between the top of the screen and the cursor are walked.
+int cursor_screen_row(Editor *ed) {
+    int visible = ed->view_rows;
+    int cur_row = get_line_number(ed, ed->doc->current_line) - 1;
+    
+    if (!ed->soft_wrap) {
+        int y = cur_row - ed->top_line;
+        return (y >= 0 && y < visible) ? y : -1;
+    }
+    
+    if (cur_row < ed->top_line) return -1;
+    
+    Line *line = get_line_at(ed, ed->top_line + 1);
+    int y = -ed->top_sub;
+    
+    while (line && line != ed->doc->current_line && y < visible) {
+        y += wrap_rows(ed, line);
+        line = line->next;
+    }
+    if (line != ed->doc->current_line) return -1;
+    
+    y += wrap_row_of(ed, line, ed->doc->cursor_x);
+    return (y >= 0 && y < visible) ? y : -1;
+}
+
+// Scroll so the cursor is on screen
+void scroll_to_cursor(Editor *ed) {
+    int visible = ed->view_rows;
+    int cur_row = get_line_number(ed, ed->doc->current_line) - 1;
+    
+    if (ed->soft_wrap) {
+        int sub = wrap_row_of(ed, ed->doc->current_line, ed->doc->cursor_x);
         
-        if (wrap_pos > ed->format.left_margin) {
-            // Save cursor position relative to wrap
-            int cursor_offset = ed->doc.cursor_x - wrap_pos - 1;
-            
-            // Move to wrap position
-            ed->doc.cursor_x = wrap_pos;
-            new_line(ed);
-            
-            // Move wrapped text
-            Line *next = ed->doc.current_line;
-            char *wrapped = &line->text[wrap_pos + 1];
-            int wrapped_len = line->length - wrap_pos - 1;
+        ed->screen_col = 0;
+        if (cur_row < ed->top_line || (cur_row == ed->top_line && sub < ed->top_sub)) {
+            ed->top_line = cur_row;
+            ed->top_sub = sub;
+        } else if (cursor_screen_row(ed) < 0) {
+            // Put the cursor on the bottom row
+            ed->top_line = cur_row;
+            ed->top_sub = sub;
+            shift_top(ed, -(visible - 1));
+        }
+        return;
+    }
+    
+    ed->top_sub = 0;
+    if (cur_row < ed->top_line) {
+        ed->top_line = cur_row;
+    } else if (cur_row >= ed->top_line + visible) {
+        ed->top_line = cur_row - visible + 1;
+    }
+    
+    // Adjust horizontal scroll
+    int col = line_col(ed, ed->doc->current_line, ed->doc->cursor_x);
+    if (col < ed->screen_col) {
+        ed->screen_col = col;
+    } else if (col >= ed->screen_col + SCREEN_WIDTH) {
+        ed->screen_col = col - SCREEN_WIDTH + 1;
+    }
+}
+
+// Toggle display-only soft wrap
+void toggle_soft_wrap(Editor *ed) {
+    ed->soft_wrap = !ed->soft_wrap;
+    ed->top_sub = 0;
+    update_status(ed, ed->soft_wrap ? "Soft wrap ON" : "Soft wrap OFF");
+}
+
+// Check if line is in block
+int is_line_in_block(Editor *ed, Line *line) {
+    if (!ed->doc->block.active || !ed->doc->block.start.line || !ed->doc->block.end.line) return 0;
+    
+    return ed->doc->block.start.line->order <= line->order &&
+           line->order <= ed->doc->block.end.line->order;
+}
+
+// Get the columns of a line covered by the block as [*from, *to);
+// *to is -1 when the block runs on past the end of the line
+int block_span(Editor *ed, Line *line, int *from, int *to) {
+    Block *b = &ed->doc->block;
+    
+    if (!is_line_in_block(ed, line)) return 0;
+    
+    if (b->column_mode) {
+        *from = b->start.col < b->end.col ? b->start.col : b->end.col;
+        *to = b->start.col < b->end.col ? b->end.col : b->start.col;
+    } else {
+        *from = (line == b->start.line) ? b->start.col : 0;
+        *to = (line == b->end.line) ? b->end.col : -1;
+    }
+    
+    return *from != *to;
+}
+
+// Get line number, walking from the last line resolved; the order keys
+// say which direction to go
+int get_line_number(Editor *ed, Line *target) {
+    Line *line = ed->doc->hint_line;
+    int num = ed->doc->hint_row;
+    
+    if (!line) {
+        line = ed->doc->first_line;
+        num = 1;
+    }
+    
+    if (target->order >= line->order) {
+        while (line && line != target) {
+            line = line->next;
+            num++;
+        }
+    } else {
+        while (line && line != target) {
+            line = line->prev;
+            num--;
+        }
+    }
+    
+    if (!line) return 1;
+    
+    ed->doc->hint_line = target;
+    ed->doc->hint_row = num;
+    return num;
+}
+
+// Get the line with a given number (clamped to the document), walking from
+// the last line resolved or from the top, whichever is nearer
+Line *get_line_at(Editor *ed, int num) {
+    Line *line = ed->doc->hint_line;
+    int row = ed->doc->hint_row;
+    
+    if (!line || num - 1 < abs(num - row)) {
+        line = ed->doc->first_line;
+        row = 1;
+    }
+    
+    while (row < num && line->next) {
+        line = line->next;
+        row++;
+    }
+    while (row > num && line->prev) {
+        line = line->prev;
+        row--;
+    }
+    
+    ed->doc->hint_line = line;
+    ed->doc->hint_row = row;
+    return line;
+}
+
+// Insert character
+void insert_char(Editor *ed, char ch) {
+    insert_text(ed, &ch, 1);
+}
+
+// Insert a typed code point, stored as UTF-8
+void insert_codepoint(Editor *ed, unsigned cp) {
+    char buf[4];
+    insert_text(ed, buf, utf8_encode(cp, buf));
+}
+
+// Type one character's bytes at the cursor; in overtype mode they replace
+// the whole character under the cursor
+void insert_text(Editor *ed, const char *text, int len) {
+    Line *line = ed->doc->current_line;
+    int x = ed->doc->cursor_x;
+    int removed = 0;
+    
+    if (!ed->insert_mode && x < line->length) removed = next_char(line, x) - x;
+    replace_range(ed, line, x, line, x + removed, text, len, NULL, &ed->doc->cursor_x);
+    
+    // Word wrap if enabled (soft wrap keeps long lines whole)
+    if (ed->format.word_wrap && !ed->soft_wrap &&
+        line_col(ed, line, line->length) > ed->format.right_margin) {
+        wrap_paragraph_tail(ed, line);
+    }
+}
+
+// Push words past the right margin down into the following lines of the
+// paragraph, opening a new line only at the paragraph's end. Stops at the
+// first line that still fits, so only the lines whose breaks change are
+// touched.
+void wrap_paragraph_tail(Editor *ed, Line *line) {
+    int left = ed->format.left_margin > 1 ? ed->format.left_margin - 1 : 0;
+    
+    while (line_col(ed, line, line->length) > ed->format.right_margin) {
+        // Last blank at which the head of the line still fits
+        int indent = 0;
+        while (indent < line->length && line->text[indent] == ' ') indent++;
+        
+        int brk = line_byte_at_col(ed, line, ed->format.right_margin);
+        while (brk > indent && line->text[brk] != ' ') brk--;
+        if (brk <= indent) break;  // A single word wider than the margin
+        
+        int head = brk;
+        while (head > indent && line->text[head - 1] == ' ') head--;
+        int tail = brk;
+        while (tail < line->length && line->text[tail] == ' ') tail++;
+        int tail_len = line->length - tail;
+        if (tail_len == 0) break;  // Only blanks overflow
+        
+        // Continue the paragraph on the next line, or start a new one
+        Line *next = line->next;
+        int at;
+        if (next && next->length > 0) {
+            line_warm(next);
+            at = 0;
+            while (at < next->length && next->text[at] == ' ') at++;
             
-            if (wrapped_len > 0) {
-                memmove(&next->text[ed->format.left_margin - 1], wrapped, wrapped_len);
-                next->length = ed->format.left_margin - 1 + wrapped_len;
-                next->text[next->length] = '\0';
-                line->length = wrap_pos;
-                line->text[line->length] = '\0';
+            line_reserve(next, next->length + tail_len + 1);
+            memmove(&next->text[at + tail_len + 1], &next->text[at], next->length - at + 1);
+            next->text[at + tail_len] = ' ';
+            next->length += tail_len + 1;
+            // Shift everything from the old first word on, including col at
+            adjust_anchors(ed, next, at - 1, 0, tail_len + 1);
+        } else {
+            next = alloc_line(left + tail_len + 256);
+            memset(next->text, ' ', left);
+            next->length = left + tail_len;
+            at = left;
+        }
+        memcpy(&next->text[at], &line->text[tail], tail_len);
+        next->text[next->length] = '\0';
+        if (next != line->next) link_lines(ed, line, next, next, 1);
+        
+        // Carry the cursor and anchors with the text they were in
+        if (ed->doc->current_line == line && ed->doc->cursor_x > head) {
+            if (ed->doc->cursor_x >= tail) {
+                ed->doc->current_line = next;
+                ed->doc->cursor_x = at + ed->doc->cursor_x - tail;
+            } else {
+                ed->doc->cursor_x = head;
             }
-            
-            // Position cursor
-            ed->doc.cursor_x = ed->format.left_margin - 1 + cursor_offset;
         }
+        move_anchors(ed, line, tail, next, at);
+        adjust_anchors(ed, line, head, line->length - head, 0);
+        
+        line_own(line);
+        line->length = head;
+        line->text[head] = '\0';
+        line_changed(ed, line);
+        line_changed(ed, next);
+        
+        line = next;
     }
 }
 
 // Delete character
 void delete_char(Editor *ed) {
-    Line *line = ed->doc.current_line;
+    Line *line = ed->doc->current_line;
+    int x = ed->doc->cursor_x;
     
-    if (ed->doc.cursor_x < line->length) {
-        memmove(&line->text[ed->doc.cursor_x], &line->text[ed->doc.cursor_x + 1], 
-                line->length - ed->doc.cursor_x);
-        line->length--;
-        ed->doc.modified = 1;
+    if (x < line->length) {
+        delete_range(ed, line, x, line, next_char(line, x));
     } else if (line->next) {
         // Join with next line
-        Line *next = line->next;
-        int new_length = line->length + next->length;
-        
-        if (new_length >= line->capacity) {
-            line->capacity = new_length + 256;
-            line->text = (char *)realloc(line->text, line->capacity);
-        }
-        
-        strcpy(&line->text[line->length], next->text);
-        line->length = new_length;
-        
-        line->next = next->next;
-        if (next->next) {
-            next->next->prev = line;
-        }
-        
-        free_line(next);
-        ed->doc.line_count--;
-        ed->doc.modified = 1;
+        delete_range(ed, line, x, line->next, 0);
     }
 }
 
 // Backspace
 void backspace_char(Editor *ed) {
-    if (ed->doc.cursor_x > 0) {
-        ed->doc.cursor_x--;
+    if (ed->doc->cursor_x > 0) {
+        ed->doc->cursor_x = prev_char(ed->doc->current_line, ed->doc->cursor_x);
         delete_char(ed);
-    } else if (ed->doc.current_line->prev) {
+    } else if (ed->doc->current_line->prev) {
         // Join with previous line
-        Line *prev = ed->doc.current_line->prev;
-        ed->doc.cursor_x = prev->length;
-        ed->doc.current_line = prev;
+        Line *prev = ed->doc->current_line->prev;
+        ed->doc->cursor_x = prev->length;
+        ed->doc->current_line = prev;
         delete_char(ed);
     }
 }
 
 // Cursor movement functions
 void move_cursor_left(Editor *ed) {
-    if (ed->doc.cursor_x > 0) {
-        ed->doc.cursor_x--;
-    } else if (ed->doc.current_line->prev) {
-        ed->doc.current_line = ed->doc.current_line->prev;
-        ed->doc.cursor_x = ed->doc.current_line->length;
+    if (ed->doc->cursor_x > 0) {
+        ed->doc->cursor_x = prev_char(ed->doc->current_line, ed->doc->cursor_x);
+    } else if (ed->doc->current_line->prev) {
+        ed->doc->current_line = ed->doc->current_line->prev;
+        ed->doc->cursor_x = ed->doc->current_line->length;
     }
 }
 
 void move_cursor_right(Editor *ed) {
-    if (ed->doc.cursor_x < ed->doc.current_line->length) {
-        ed->doc.cursor_x++;
-    } else if (ed->doc.current_line->next) {
-        ed->doc.current_line = ed->doc.current_line->next;
-        ed->doc.cursor_x = 0;
+    if (ed->doc->cursor_x < ed->doc->current_line->length) {
+        ed->doc->cursor_x = next_char(ed->doc->current_line, ed->doc->cursor_x);
+    } else if (ed->doc->current_line->next) {
+        ed->doc->current_line = ed->doc->current_line->next;
+        ed->doc->cursor_x = 0;
     }
 }
 
 void move_cursor_up(Editor *ed) {
-    if (ed->doc.current_line->prev) {
-        ed->doc.current_line = ed->doc.current_line->prev;
-        if (ed->doc.cursor_x > ed->doc.current_line->length) {
-            ed->doc.cursor_x = ed->doc.current_line->length;
-        }
+    if (ed->soft_wrap) {
+        move_visual_row(ed, -1);
+    } else if (ed->doc->current_line->prev) {
+        int col = line_col(ed, ed->doc->current_line, ed->doc->cursor_x);
+        ed->doc->current_line = ed->doc->current_line->prev;
+        ed->doc->cursor_x = line_byte_at_col(ed, ed->doc->current_line, col);
     }
 }
 
 void move_cursor_down(Editor *ed) {
-    if (ed->doc.current_line->next) {
-        ed->doc.current_line = ed->doc.current_line->next;
-        if (ed->doc.cursor_x > ed->doc.current_line->length) {
-            ed->doc.cursor_x = ed->doc.current_line->length;
-        }
+    if (ed->soft_wrap) {
+        move_visual_row(ed, 1);
+    } else if (ed->doc->current_line->next) {
+        int col = line_col(ed, ed->doc->current_line, ed->doc->cursor_x);
+        ed->doc->current_line = ed->doc->current_line->next;
+        ed->doc->cursor_x = line_byte_at_col(ed, ed->doc->current_line, col);
     }
 }
 
 // Move by word
 void move_word_left(Editor *ed) {
     // Skip current word
-    while (ed->doc.cursor_x > 0 && !isspace(ed->doc.current_line->text[ed->doc.cursor_x - 1])) {
-        ed->doc.cursor_x--;
+    while (ed->doc->cursor_x > 0 && !isspace((unsigned char)ed->doc->current_line->text[ed->doc->cursor_x - 1])) {
+        ed->doc->cursor_x--;
     }
     // Skip spaces
-    while (ed->doc.cursor_x > 0 && isspace(ed->doc.current_line->text[ed->doc.cursor_x - 1])) {
-        ed->doc.cursor_x--;
+    while (ed->doc->cursor_x > 0 && isspace((unsigned char)ed->doc->current_line->text[ed->doc->cursor_x - 1])) {
+        ed->doc->cursor_x--;
     }
 }
 
 void move_word_right(Editor *ed) {
-    Line *line = ed->doc.current_line;
+    Line *line = ed->doc->current_line;
     // Skip current word
-    while (ed->doc.cursor_x < line->length && !isspace(line->text[ed->doc.cursor_x])) {
-        ed->doc.cursor_x++;
+    while (ed->doc->cursor_x < line->length && !isspace((unsigned char)line->text[ed->doc->cursor_x])) {
+        ed->doc->cursor_x++;
     }
     // Skip spaces
-    while (ed->doc.cursor_x < line->length && isspace(line->text[ed->doc.cursor_x])) {
-        ed->doc.cursor_x++;
+    while (ed->doc->cursor_x < line->length && isspace((unsigned char)line->text[ed->doc->cursor_x])) {
+        ed->doc->cursor_x++;
     }
 }
 
 // Line movement
 void move_line_start(Editor *ed) {
-    ed->doc.cursor_x = 0;
+    ed->doc->cursor_x = 0;
 }
 
 void move_line_end(Editor *ed) {
-    ed->doc.cursor_x = ed->doc.current_line->length;
+    ed->doc->cursor_x = ed->doc->current_line->length;
 }
 
 // Scrolling
 void scroll_up(Editor *ed) {
-    if (ed->doc.current_line->prev) {
-        ed->doc.current_line = ed->doc.current_line->prev;
+    if (ed->doc->current_line->prev) {
+        ed->doc->current_line = ed->doc->current_line->prev;
         if (ed->top_line > 0) ed->top_line--;
     }
+    if (ed->doc->cursor_x > ed->doc->current_line->length) {
+        ed->doc->cursor_x = ed->doc->current_line->length;
+    }
 }
 
 void scroll_down(Editor *ed) {
-    if (ed->doc.current_line->next) {
-        ed->doc.current_line = ed->doc.current_line->next;
+    if (ed->doc->current_line->next) {
+        ed->doc->current_line = ed->doc->current_line->next;
         ed->top_line++;
     }
+    if (ed->doc->cursor_x > ed->doc->current_line->length) {
+        ed->doc->cursor_x = ed->doc->current_line->length;
+    }
 }
 
 // Page movement
 void move_page_up(Editor *ed) {
-    int lines = EDIT_END - EDIT_START;
-    for (int i = 0; i < lines && ed->doc.current_line->prev; i++) {
-        ed->doc.current_line = ed->doc.current_line->prev;
+    int lines = ed->view_rows > 1 ? ed->view_rows - 1 : 1;
+    if (ed->soft_wrap) {
+        for (int i = 0; i < lines; i++) {
+            move_visual_row(ed, -1);
+        }
+        shift_top(ed, -lines);
+        return;
+    }
+    for (int i = 0; i < lines && ed->doc->current_line->prev; i++) {
+        ed->doc->current_line = ed->doc->current_line->prev;
+    }
+    if (ed->doc->cursor_x > ed->doc->current_line->length) {
+        ed->doc->cursor_x = ed->doc->current_line->length;
     }
     if (ed->top_line >= lines) {
         ed->top_line -= lines;
@@ -733,467 +2221,3493 @@ void move_page_up(Editor *ed) {
 }
 
 void move_page_down(Editor *ed) {
-    int lines = EDIT_END - EDIT_START;
-    for (int i = 0; i < lines && ed->doc.current_line->next; i++) {
-        ed->doc.current_line = ed->doc.current_line->next;
+    int lines = ed->view_rows > 1 ? ed->view_rows - 1 : 1;
+    if (ed->soft_wrap) {
+        for (int i = 0; i < lines; i++) {
+            move_visual_row(ed, 1);
+        }
+        shift_top(ed, lines);
+        return;
+    }
+    for (int i = 0; i < lines && ed->doc->current_line->next; i++) {
+        ed->doc->current_line = ed->doc->current_line->next;
+    }
+    if (ed->doc->cursor_x > ed->doc->current_line->length) {
+        ed->doc->cursor_x = ed->doc->current_line->length;
     }
     ed->top_line += lines;
 }
 
 // Document movement
 void move_doc_start(Editor *ed) {
-    ed->doc.current_line = ed->doc.first_line;
-    ed->doc.cursor_x = 0;
+    if (ed->doc->view) view_goto(ed, 0);
+    ed->doc->current_line = ed->doc->first_line;
+    ed->doc->cursor_x = 0;
     ed->top_line = 0;
+    ed->top_sub = 0;
 }
 
 void move_doc_end(Editor *ed) {
-    while (ed->doc.current_line->next) {
-        ed->doc.current_line = ed->doc.current_line->next;
+    if (ed->doc->view && view_defer(ed, LLONG_MAX, INT_MAX)) return;
+    if (ed->doc->view) view_goto(ed, LLONG_MAX);
+    while (ed->doc->current_line->next) {
+        ed->doc->current_line = ed->doc->current_line->next;
     }
-    ed->doc.cursor_x = ed->doc.current_line->length;
+    ed->doc->cursor_x = ed->doc->current_line->length;
 }
 
 // New line
 void new_line(Editor *ed) {
-    Line *new = create_line();
-    Line *curr = ed->doc.current_line;
-    
-    // Split current line
-    if (ed->doc.cursor_x < curr->length) {
-        strcpy(new->text, &curr->text[ed->doc.cursor_x]);
-        new->length = strlen(new->text);
-        curr->text[ed->doc.cursor_x] = '\0';
-        curr->length = ed->doc.cursor_x;
-    }
+    Line *curr = ed->doc->current_line;
+    int x = ed->doc->cursor_x;
+    int indent = 0;
     
-    // Auto-indent
-    if (ed->auto_indent && ed->doc.cursor_x == 0) {
-        int indent = 0;
-        while (indent < curr->length && (curr->text[indent] == ' ' || curr->text[indent] == '\t')) {
+    // Auto-indent: the new line starts with the blanks this one starts with
+    if (ed->auto_indent) {
+        while (indent < x && (curr->text[indent] == ' ' || curr->text[indent] == '\t')) {
             indent++;
         }
-        if (indent > 0 && indent < new->capacity) {
-            memmove(&new->text[indent], new->text, new->length + 1);
-            memcpy(new->text, curr->text, indent);
-            new->length += indent;
-        }
-    }
-    
-    // Insert new line
-    new->next = curr->next;
-    new->prev = curr;
-    if (curr->next) {
-        curr->next->prev = new;
     }
-    curr->next = new;
     
-    ed->doc.current_line = new;
-    ed->doc.cursor_x = (ed->auto_indent && ed->doc.cursor_x == 0) ? 
-                        (new->length - strlen(&curr->text[ed->doc.cursor_x])) : 0;
-    ed->doc.line_count++;
-    ed->doc.modified = 1;
+    char *text = (char *)malloc(indent + 1);
+    text[0] = '\n';
+    memcpy(&text[1], curr->text, indent);
+    insert_string(ed, curr, x, text, indent + 1, &ed->doc->current_line, &ed->doc->cursor_x);
+    free(text);
 }
 
 // Delete line
 void delete_line(Editor *ed) {
-    Line *line = ed->doc.current_line;
+    Line *line = ed->doc->current_line;
     
-    if (ed->doc.line_count == 1) {
+    if (ed->doc->line_count == 1) {
         // Just clear the line
+        line_own(line);
         line->text[0] = '\0';
         line->length = 0;
-        ed->doc.cursor_x = 0;
+        line_changed(ed, line);
+        ed->doc->cursor_x = 0;
     } else {
         // Remove line from list
-        if (line->prev) {
-            line->prev->next = line->next;
-        } else {
-            ed->doc.first_line = line->next;
-        }
-        
-        if (line->next) {
-            line->next->prev = line->prev;
-            ed->doc.current_line = line->next;
-        } else {
-            ed->doc.current_line = line->prev;
-        }
-        
+        ed->doc->current_line = line->next ? line->next : line->prev;
+        unlink_lines(ed, line, line, 1);
         free_line(line);
-        ed->doc.line_count--;
         
-        if (ed->doc.cursor_x > ed->doc.current_line->length) {
-            ed->doc.cursor_x = ed->doc.current_line->length;
+        if (ed->doc->cursor_x > ed->doc->current_line->length) {
+            ed->doc->cursor_x = ed->doc->current_line->length;
         }
     }
     
-    ed->doc.modified = 1;
+    ed->doc->modified = 1;
 }
 
 // Delete word right
 void delete_word_right(Editor *ed) {
-    Line *line = ed->doc.current_line;
-    int start = ed->doc.cursor_x;
+    Line *line = ed->doc->current_line;
+    int start = ed->doc->cursor_x;
+    int end = start;
     
     // Skip to end of current word
-    while (ed->doc.cursor_x < line->length && !isspace(line->text[ed->doc.cursor_x])) {
-        ed->doc.cursor_x++;
+    while (end < line->length && !isspace((unsigned char)line->text[end])) {
+        end++;
     }
     // Include trailing spaces
-    while (ed->doc.cursor_x < line->length && isspace(line->text[ed->doc.cursor_x])) {
-        ed->doc.cursor_x++;
+    while (end < line->length && isspace((unsigned char)line->text[end])) {
+        end++;
     }
     
     // Delete the word
-    if (ed->doc.cursor_x > start) {
-        memmove(&line->text[start], &line->text[ed->doc.cursor_x], 
-                line->length - ed->doc.cursor_x + 1);
-        line->length -= (ed->doc.cursor_x - start);
-        ed->doc.cursor_x = start;
-        ed->doc.modified = 1;
+    if (end > start) {
+        delete_range(ed, line, start, line, end);
     }
 }
 
 // Delete to end of line
 void delete_to_eol(Editor *ed) {
-    Line *line = ed->doc.current_line;
-    if (ed->doc.cursor_x < line->length) {
-        line->text[ed->doc.cursor_x] = '\0';
-        line->length = ed->doc.cursor_x;
-        ed->doc.modified = 1;
+    Line *line = ed->doc->current_line;
+    if (ed->doc->cursor_x < line->length) {
+        delete_range(ed, line, ed->doc->cursor_x, line, line->length);
     }
 }
 
-// Save file
-void save_file(Editor *ed) {
-    FILE *fp = fopen(ed->doc.filename, "w");
-    if (!fp) {
-        update_status(ed, "Error: Cannot save file");
-        return;
-    }
+// Windows-1252 characters for bytes 0x80-0x9F; the five unassigned bytes
+// keep their C1 code points so they survive a round trip
+static const unsigned short cp1252_high[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+// Read a whole file into memory; NULL if it cannot be opened or read,
+// or is too big for a long to hold its length
+char *read_file_data(const char *filename, long *size) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
     
-    Line *line = ed->doc.first_line;
-    while (line) {
-        fprintf(fp, "%s", line->text);
-        if (line->next) {
-            fprintf(fp, "\r\n");
-        }
-        line = line->next;
+    long long len = _fseeki64(fp, 0, SEEK_END) == 0 ? _ftelli64(fp) : -1;
+    char *data = NULL;
+    if (len >= 0 && len < LONG_MAX && _fseeki64(fp, 0, SEEK_SET) == 0) {
+        data = (char *)malloc((size_t)len + 1);
+    }
+    if (data && fread(data, 1, (size_t)len, fp) != (size_t)len) {
+        free(data);
+        data = NULL;
     }
-    
     fclose(fp);
-    ed->doc.modified = 0;
-    update_status(ed, "File saved");
-}
-
-// Save file as
-void save_file_as(Editor *ed, const char *filename) {
-    strcpy(ed->doc.filename, filename);
-    save_file(ed);
+    *size = data ? (long)len : 0;
+    return data;
 }
 
-// Load file
-void load_file(Editor *ed, const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        update_status(ed, "New file");
-        strcpy(ed->doc.filename, filename);
-        return;
-    }
+// Convert UTF-16 or Windows-1252 file data to UTF-8. Unpaired surrogates
+// become U+FFFD. NULL if there isn't room for the result.
+char *convert_to_utf8(const char *data, long size, Encoding encoding, long *len) {
+    const unsigned char *u = (const unsigned char *)data;
+    long long need = (long long)size * 3 / (encoding == ENC_ANSI ? 1 : 2) + 4;
+    char *out = need < LONG_MAX ? (char *)malloc((size_t)need) : NULL;
+    long n = 0;
     
-    // Clear existing document
-    Line *line = ed->doc.first_line;
-    while (line) {
-        Line *next = line->next;
-        free_line(line);
-        line = next;
+    if (!out) {
+        *len = 0;
+        return NULL;
     }
     
-    ed->doc.first_line = create_line();
-    ed->doc.current_line = ed->doc.first_line;
-    ed->doc.line_count = 1;
-    ed->doc.cursor_x = 0;
+    if (encoding == ENC_ANSI) {
+        for (long i = 0; i < size; i++) {
+            unsigned cp = u[i] >= 0x80 && u[i] < 0xA0 ? cp1252_high[u[i] - 0x80] : u[i];
+            n += utf8_encode(cp, &out[n]);
+        }
+    } else {
+        int hi = encoding == ENC_UTF16BE ? 0 : 1;
+        for (long i = 0; i + 1 < size; i += 2) {
+            unsigned cp = (u[i + hi] << 8) | u[i + 1 - hi];
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < size) {
+                unsigned low = (u[i + 2 + hi] << 8) | u[i + 3 - hi];
+                if (low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    i += 2;
+                }
+            }
+            if (cp >= 0xD800 && cp < 0xE000) cp = 0xFFFD;
+            n += utf8_encode(cp, &out[n]);
+        }
+    }
     
-    strcpy(ed->doc.filename, filename);
+    *len = n;
+    return out;
+}
+
+// Split UTF-8 text into a detached chain of lines in a single pass,
+// recording the line ending the text mostly uses and whether the last
+// line is terminated. Counts lines that are not valid UTF-8.
+Line *split_lines(const char *text, long len, FileFormat *ff, int *count, int *invalid) {
+    Line *first = NULL;
+    Line *last = NULL;
+    long endings[3] = {0, 0, 0};  // CRLF, LF, CR
+    long i = 0;
     
-    // Read file
-    char buffer[1024];
-    Line *curr = ed->doc.first_line;
-    int first_line = 1;
+    *count = 0;
+    *invalid = 0;
+    ff->final_newline = 0;
     
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        // Remove newline
-        int len = strlen(buffer);
-        if (len > 0 && buffer[len-1] == '\n') {
-            buffer[--len] = '\0';
-        }
-        if (len > 0 && buffer[len-1] == '\r') {
-            buffer[--len] = '\0';
-        }
+    while (i < len) {
+        long start = i;
+        while (i < len && text[i] != '\n' && text[i] != '\r') i++;
         
-        if (!first_line) {
-            // Create new line
-            Line *new = create_line();
-            new->prev = curr;
-            curr->next = new;
-            curr = new;
-            ed->doc.line_count++;
+        Line *line = create_line_text(&text[start], (int)(i - start));
+        if (utf8_check(line->text, line->length) < line->length) (*invalid)++;
+        if (last) {
+            last->next = line;
+            line->prev = last;
+        } else {
+            first = line;
         }
+        last = line;
+        (*count)++;
         
-        // Store in current line
-        if (curr->capacity <= len) {
-            curr->capacity = len + 256;
-            curr->text = (char *)realloc(curr->text, curr->capacity);
+        if (i < len) {
+            if (text[i] == '\r' && i + 1 < len && text[i + 1] == '\n') {
+                endings[0]++;
+                i += 2;
+            } else {
+                endings[text[i] == '\n' ? 1 : 2]++;
+                i++;
+            }
+            ff->final_newline = i == len;
         }
-        strcpy(curr->text, buffer);
-        curr->length = len;
-        
-        first_line = 0;
     }
     
-    fclose(fp);
-    ed->doc.modified = 0;
-    update_status(ed, "File loaded");
+    if (endings[1] > endings[0] && endings[1] >= endings[2]) {
+        ff->newline = "\n";
+    } else if (endings[2] > endings[0] && endings[2] > endings[1]) {
+        ff->newline = "\r";
+    } else if (endings[0] || !ff->newline) {
+        ff->newline = "\r\n";
+    }
+    return first;
 }
 
-// Block operations
-void mark_block_begin(Editor *ed) {
-    ed->block.start_line = ed->doc.current_line;
-    ed->block.start_col = ed->doc.cursor_x;
-    if (!ed->block.active || ed->block.end_line == NULL) {
-        ed->block.end_line = ed->doc.current_line;
-        ed->block.end_col = ed->doc.cursor_x;
+// Decode file data into a detached chain of lines, detecting the encoding
+// from a byte order mark, or from whether the text is valid UTF-8, and
+// the line endings. ff keeps its newline if the file has none. *count is
+// -1 if the text is too big to convert.
+Line *decode_file(char *data, long size, FileFormat *ff, int *count) {
+    const unsigned char *u = (const unsigned char *)data;
+    int invalid;
+    Line *lines;
+    
+    ff->bom = 1;
+    if (size >= 3 && u[0] == 0xEF && u[1] == 0xBB && u[2] == 0xBF) {
+        ff->encoding = ENC_UTF8;
+        return split_lines(data + 3, size - 3, ff, count, &invalid);
     }
-    ed->block.active = 1;
-    update_status(ed, "Block begin marked");
+    if (size >= 2 && ((u[0] == 0xFF && u[1] == 0xFE) || (u[0] == 0xFE && u[1] == 0xFF))) {
+        long len;
+        ff->encoding = u[0] == 0xFF ? ENC_UTF16LE : ENC_UTF16BE;
+        char *text = convert_to_utf8(data + 2, size - 2, ff->encoding, &len);
+        if (!text) {
+            *count = -1;
+            return NULL;
+        }
+        lines = split_lines(text, len, ff, count, &invalid);
+        free(text);
+        return lines;
+    }
+    
+    ff->bom = 0;
+    ff->encoding = ENC_UTF8;
+    lines = split_lines(data, size, ff, count, &invalid);
+    if (!invalid) return lines;
+    
+    // Not UTF-8: read it as Windows-1252 instead
+    long len;
+    while (lines) {
+        Line *next = lines->next;
+        free_line(lines);
+        lines = next;
+    }
+    ff->encoding = ENC_ANSI;
+    char *text = convert_to_utf8(data, size, ENC_ANSI, &len);
+    if (!text) {
+        *count = -1;
+        return NULL;
+    }
+    lines = split_lines(text, len, ff, count, &invalid);
+    free(text);
+    return lines;
 }
 
-void mark_block_end(Editor *ed) {
-    ed->block.end_line = ed->doc.current_line;
-    ed->block.end_col = ed->doc.cursor_x;
-    if (!ed->block.active || ed->block.start_line == NULL) {
-        ed->block.start_line = ed->doc.current_line;
-        ed->block.start_col = ed->doc.cursor_x;
+// Write UTF-8 text in a file's encoding. Returns how many characters the
+// encoding cannot hold; those are written as '?'.
+int write_encoded(FILE *fp, const FileFormat *ff, const char *text, int len) {
+    int lost = 0;
+    
+    if (ff->encoding == ENC_UTF8) {
+        fwrite(text, 1, len, fp);
+        return 0;
     }
-    ed->block.active = 1;
-    update_status(ed, "Block end marked");
+    
+    for (int i = 0; i < len; ) {
+        unsigned cp;
+        int n = utf8_decode(&text[i], len - i, &cp);
+        if (!n) {
+            n = 1;
+            cp = 0xFFFD;
+        }
+        i += n;
+        
+        if (ff->encoding == ENC_ANSI) {
+            int byte = cp < 0x80 || (cp >= 0xA0 && cp <= 0xFF) ? (int)cp : -1;
+            for (int b = 0; b < 32 && byte < 0; b++) {
+                if (cp1252_high[b] == cp) byte = 0x80 + b;
+            }
+            if (byte < 0) {
+                byte = '?';
+                lost++;
+            }
+            putc(byte, fp);
+        } else {
+            unsigned units[2] = {cp, 0};
+            int count = 1;
+            if (cp >= 0x10000) {
+                units[0] = 0xD800 + ((cp - 0x10000) >> 10);
+                units[1] = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+                count = 2;
+            }
+            for (int k = 0; k < count; k++) {
+                if (ff->encoding == ENC_UTF16LE) {
+                    putc(units[k] & 0xFF, fp);
+                    putc(units[k] >> 8, fp);
+                } else {
+                    putc(units[k] >> 8, fp);
+                    putc(units[k] & 0xFF, fp);
+                }
+            }
+        }
+    }
+    return lost;
 }
 
-void hide_block(Editor *ed) {
-    ed->block.active = 0;
-    update_status(ed, "Block hidden");
+// Write the byte order mark for a file's encoding, if it had one
+void write_bom(FILE *fp, const FileFormat *ff) {
+    if (!ff->bom) return;
+    if (ff->encoding == ENC_UTF8) fwrite("\xEF\xBB\xBF", 1, 3, fp);
+    if (ff->encoding == ENC_UTF16LE) fwrite("\xFF\xFE", 1, 2, fp);
+    if (ff->encoding == ENC_UTF16BE) fwrite("\xFE\xFF", 1, 2, fp);
 }
 
-// Clear clipboard
-void clear_clipboard(Editor *ed) {
-    Line *line = ed->clipboard;
-    while (line) {
-        Line *next = line->next;
-        free_line(line);
-        line = next;
+// Short description of a file format for the status line
+const char *format_name(const FileFormat *ff, char *buf, int size) {
+    static const char *names[] = {"UTF-8", "UTF-16LE", "UTF-16BE", "ANSI"};
+    const char *eol = ff->newline[0] == '\n' ? "LF" : ff->newline[1] ? "CRLF" : "CR";
+    
+    snprintf(buf, size, "%s%s %s", names[ff->encoding],
+             ff->bom && ff->encoding == ENC_UTF8 ? " BOM" : "", eol);
+    return buf;
+}
+
+// Write a save's snapshot to a temporary file. finish_save() puts it in
+// place of the file, so until the journal is settled the file on disk is
+// the one the journal applies to.
+static unsigned __stdcall save_writer(void *arg) {
+    SaveJob *job = (SaveJob *)arg;
+    const FileFormat *ff = &job->file;
+    int newline_len = strlen(ff->newline);
+    ColdChunk *unpacked = NULL;
+    char *raw = NULL;
+    
+    FILE *fp = fopen(job->temp, "wb");
+    if (!fp) {
+        job->failed = 1;
+        return 0;
+    }
+    setvbuf(fp, NULL, _IOFBF, SAVE_BUFFER);
+    
+    write_bom(fp, ff);
+    for (int i = 0; i < job->count; i++) {
+        SaveText *t = &job->lines[i];
+        const char *text = t->text;
+        if (t->cold) {
+            // Unpacked here, apart from the UI thread's peek buffer
+            if (t->cold != unpacked) {
+                raw = (char *)realloc(raw, t->cold->raw_len);
+                lz_unpack(t->cold->packed, t->cold->packed_len, raw, t->cold->raw_len);
+                unpacked = t->cold;
+            }
+            text = &raw[t->offset];
+        }
+        job->lost += write_encoded(fp, ff, text, t->length);
+        if (i + 1 < job->count || ff->final_newline) {
+            write_encoded(fp, ff, ff->newline, newline_len);
+        }
+    }
+    
+    free(raw);
+    job->failed = ferror(fp);
+    if (fclose(fp) != 0) job->failed = 1;
+    if (job->failed) remove(job->temp);
+    return 0;
+}
+
+// Start saving the current document in the encoding and line endings it
+// was loaded with. The lines' text is snapshotted, not copied, and a
+// worker writes it out while editing goes on.
+void start_save(Editor *ed) {
+    Document *doc = ed->doc;
+    
+    // One save of a document at a time
+    finish_save(ed, doc);
+    
+    SaveJob *job = (SaveJob *)calloc(1, sizeof(SaveJob));
+    strcpy(job->filename, doc->filename);
+    snprintf(job->temp, MAX_PATH, "%s%s", doc->filename, SAVE_EXT);
+    job->file = doc->file;
+    job->lines = (SaveText *)malloc(doc->line_count * sizeof(SaveText));
+    for (Line *line = doc->first_line; line && job->count < doc->line_count; line = line->next) {
+        SaveText *t = &job->lines[job->count++];
+        t->text = line->text;
+        t->length = line->length;
+        t->cold = line->cold;
+        if (line->cold) {
+            // Compressed text never changes; the chunk is kept until written
+            t->offset = line->cold->offsets[line->capacity];
+            line->cold->refs++;
+        } else {
+            line->save = job;
+        }
+    }
+    
+    // Journal records up to here are in the file being written
+    commit_journals(ed);
+    job->changes = doc->changes;
+    job->journal_mark = doc->journal ? doc->journal->written : -1;
+    
+    job->thread = (HANDLE)_beginthreadex(NULL, 0, save_writer, job, 0, NULL);
+    doc->save = job;
+    ed->saving++;
+    update_status(ed, "Saving...");
+}
+
+// Wait for a document's save to end and stop sharing text with it
+void release_save(Document *doc) {
+    SaveJob *job = doc->save;
+    if (!job) return;
+    
+    WaitForSingleObject(job->thread, INFINITE);
+    CloseHandle(job->thread);
+    
+    for (Line *line = doc->first_line; line; line = line->next) {
+        if (line->save == job) line->save = NULL;
+    }
+    for (int i = 0; i < job->count; i++) {
+        ColdChunk *chunk = job->lines[i].cold;
+        if (chunk) {
+            chunk->refs--;
+            drop_chunk(chunk);
+        }
+    }
+    for (int i = 0; i < job->retired_count; i++) {
+        free(job->retired[i]);
+    }
+    free(job->retired);
+    free(job->lines);
+    free(job);
+    doc->save = NULL;
+}
+
+// Wait for a document's save and settle the outcome. The document stays
+// modified if it was edited while the save ran, and its journal then
+// keeps only those edits.
+void finish_save(Editor *ed, Document *doc) {
+    SaveJob *job = doc->save;
+    if (!job) return;
+    
+    WaitForSingleObject(job->thread, INFINITE);
+    int failed = job->failed;
+    if (!failed && !MoveFileEx(job->temp, job->filename, MOVEFILE_REPLACE_EXISTING)) {
+        remove(job->temp);
+        failed = 1;
+    }
+    int lost = job->lost;
+    unsigned long changes = job->changes;
+    long mark = job->journal_mark;
+    FileFormat ff = job->file;
+    release_save(doc);
+    ed->saving--;
+    
+    if (failed) {
+        update_status(ed, "Error: Cannot save file");
+        return;
+    }
+    file_stamp(doc->filename, &doc->disk_size, &doc->disk_time);
+    doc->disk_sample = file_sample(doc->filename, doc->disk_size);
+    doc->follow_held = 0;
+    if (doc->changes == changes) {
+        doc->modified = 0;
+        close_journal(doc, 1);
+    } else {
+        rebase_journal(ed, doc, mark);
+    }
+    
+    if (lost) {
+        char msg[80], name[32];
+        snprintf(msg, sizeof(msg), "File saved - %d characters not in %s written as ?",
+                 lost, format_name(&ff, name, sizeof(name)));
+        update_status(ed, msg);
+    } else {
+        update_status(ed, "File saved");
+    }
+}
+
+// Settle the saves whose writer is done. Returns how many there were.
+int finish_saves(Editor *ed) {
+    int done = 0;
+    
+    for (int i = 0; i < ed->doc_count; i++) {
+        SaveJob *job = ed->docs[i]->save;
+        if (job && WaitForSingleObject(job->thread, 0) == WAIT_OBJECT_0) {
+            finish_save(ed, ed->docs[i]);
+            done++;
+        }
+    }
+    return done;
+}
+
+// Save file, waiting until it is written
+void save_file(Editor *ed) {
+    start_save(ed);
+    finish_save(ed, ed->doc);
+}
+
+// Save file as
+void save_file_as(Editor *ed, const char *filename) {
+    finish_save(ed, ed->doc);
+    // Saving under its own name asks first, as ^KS does
+    if (_stricmp(filename, ed->doc->filename) == 0 && ask_overwrite(ed, CONFIRM_OVERWRITE)) return;
+    strcpy(ed->doc->filename, filename);
+    start_save(ed);
+}
+
+// Load file, reading it whole and splitting lines in one pass
+void load_file(Editor *ed, const char *filename) {
+    long size;
+    int count;
+    
+    file_stamp(filename, &ed->doc->disk_size, &ed->doc->disk_time);
+    ed->doc->disk_sample = file_sample(filename, ed->doc->disk_size);
+    
+    // Files too big to hold are paged from disk instead
+    if (!ed->batch && ed->doc->disk_size > 0 &&
+        (ed->view_files || ed->doc->disk_size >= VIEW_AUTO_SIZE) && open_view(ed, filename)) {
+        return;
+    }
+    
+    char *data = read_file_data(filename, &size);
+    if (!data && ed->doc->disk_size < 0) {
+        update_status(ed, "New file");
+        strcpy(ed->doc->filename, filename);
+        recover_journal(ed);
+        return;
+    }
+    FileFormat ff = ed->doc->file;
+    Line *first = data ? decode_file(data, size, &ff, &count) : NULL;
+    free(data);
+    if (!data || count < 0) {
+        // Too big to hold whole: page it if it can be, else leave it be
+        if (!ed->batch && open_view(ed, filename)) return;
+        ed->doc->disk_size = -1;
+        update_status(ed, "Error: File too big to load");
+        return;
+    }
+    
+    // Clear existing document
+    Line *line = ed->doc->first_line;
+    while (line) {
+        Line *next = line->next;
+        free_line(line);
+        line = next;
+    }
+    ed->doc->first_line = NULL;
+    ed->doc->line_count = 0;
+    ed->doc->cursor_x = 0;
+    clear_anchors(ed);
+    ed->doc->block.active = 0;
+    
+    strcpy(ed->doc->filename, filename);
+    ed->doc->file = ff;
+    
+    if (!first) {
+        first = create_line();
+        count = 1;
+    }
+    Line *last = first;
+    while (last->next) last = last->next;
+    
+    int journal_off = ed->journal_off;
+    ed->journal_off = 1;
+    link_lines(ed, NULL, first, last, count);
+    ed->journal_off = journal_off;
+    ed->doc->current_line = ed->doc->first_line;
+    ed->doc->modified = 0;
+    
+    char msg[80], name[32];
+    snprintf(msg, sizeof(msg), "File loaded - %s", format_name(&ed->doc->file, name, sizeof(name)));
+    update_status(ed, msg);
+    recover_journal(ed);
+}
+
+// Size and modification time of a file, size -1 if it doesn't exist
+void file_stamp(const char *filename, long long *size, long long *mtime) {
+    struct _stat64 st;
+    
+    if (_stat64(filename, &st) == 0) {
+        *size = st.st_size;
+        *mtime = st.st_mtime;
+    } else {
+        *size = -1;
+        *mtime = 0;
+    }
+}
+
+// Length of data up to and including its first `want` line breaks (CRLF,
+// LF or CR), with *found set to how many it had. Short of that many, all
+// of data, less a final CR whose LF may still follow unless this is the
+// end of the text; *last gets the end of the last break counted.
+static long line_breaks(const char *data, long n, long long want, long long *found,
+                        long *last, int end) {
+    long i = 0;
+    
+    *found = 0;
+    *last = 0;
+    while (i < n && *found < want) {
+        char c = data[i++];
+        if (c != '\n' && c != '\r') continue;
+        if (c == '\r') {
+            if (i == n && !end) return i - 1;
+            if (i < n && data[i] == '\n') i++;
+        }
+        (*found)++;
+        *last = i;
+    }
+    return i;
+}
+
+// Index entry k of a paged file
+static long long *view_entry(FileView *v, long long k) {
+    return &v->index[k >> VIEW_INDEX_SHIFT][k & ((1 << VIEW_INDEX_SHIFT) - 1)];
+}
+
+// Record where a line starts, if it is one the index keeps
+static void view_mark(FileView *v, long long line, long long at) {
+    long long k = line / VIEW_INDEX_STEP;
+    
+    if (line % VIEW_INDEX_STEP || at >= v->size || (k >> VIEW_INDEX_SHIFT) >= VIEW_INDEX_BLOCKS) {
+        return;
+    }
+    if (!v->index[k >> VIEW_INDEX_SHIFT]) {
+        v->index[k >> VIEW_INDEX_SHIFT] = (long long *)malloc(sizeof(long long) << VIEW_INDEX_SHIFT);
+    }
+    *view_entry(v, k) = at;
+    
+    EnterCriticalSection(&v->lock);
+    v->indexed = k + 1;
+    LeaveCriticalSection(&v->lock);
+}
+
+// Name of the line index kept for a file
+void index_path(const char *filename, char *path) {
+    snprintf(path, MAX_PATH, "%s%s", filename, INDEX_EXT);
+}
+
+// Hash of the bytes at each end of a file, to tell one rewritten at the
+// same size within the same second
+static unsigned long long view_sample(FILE *fp, long long size) {
+    unsigned char buf[INDEX_SAMPLE];
+    unsigned long long hash = 14695981039346656037ULL;
+    long long at[2] = {0, size > INDEX_SAMPLE ? size - INDEX_SAMPLE : 0};
+    
+    for (int i = 0; i < 2; i++) {
+        _fseeki64(fp, at[i], SEEK_SET);
+        size_t n = fread(buf, 1, sizeof(buf), fp);
+        for (size_t j = 0; j < n; j++) {
+            hash = (hash ^ buf[j]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Hash of the bytes at each end of a file of the given size, 0 if it
+// can't be read
+unsigned long long file_sample(const char *filename, long long size) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return 0;
+    
+    unsigned long long hash = view_sample(fp, size);
+    fclose(fp);
+    return hash;
+}
+
+// Keep a finished index next to its file, so opening the file again
+// needn't read it all. The index is only a cache: failing to write it
+// just leaves none.
+static void save_index(FileView *v, FILE *fp) {
+    char path[MAX_PATH];
+    
+    index_path(v->path, path);
+    FILE *out = fopen(path, "wb");
+    if (!out) return;
+    
+    fprintf(out, "WSX1 %lld %lld %d %lld %lld %llu\n", v->size, v->mtime, VIEW_INDEX_STEP,
+            v->lines, v->indexed, view_sample(fp, v->size));
+    for (long long k = 0; k < v->indexed; k += 1 << VIEW_INDEX_SHIFT) {
+        long long n = v->indexed - k < (1 << VIEW_INDEX_SHIFT) ? v->indexed - k : 1 << VIEW_INDEX_SHIFT;
+        fwrite(view_entry(v, k), sizeof(long long), (size_t)n, out);
+    }
+    
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed) remove(path);
+}
+
+// Take a paged file's index from the one kept next to it, if that was
+// made from the file as it is now
+static int load_index(FileView *v) {
+    char path[MAX_PATH];
+    long long size, mtime, lines, entries;
+    unsigned long long sample;
+    int step;
+    
+    index_path(v->path, path);
+    FILE *in = fopen(path, "rb");
+    if (!in) return 0;
+    
+    int ok = fscanf(in, "WSX1 %lld %lld %d %lld %lld %llu", &size, &mtime, &step, &lines,
+                    &entries, &sample) == 6 && fgetc(in) == '\n' &&
+             size == v->size && mtime == v->mtime && step == VIEW_INDEX_STEP && lines > 0 &&
+             entries > 0 && ((entries - 1) >> VIEW_INDEX_SHIFT) < VIEW_INDEX_BLOCKS &&
+             sample == view_sample(v->fp, v->size);
+    for (long long k = 0; ok && k < entries; k += 1 << VIEW_INDEX_SHIFT) {
+        long long n = entries - k < (1 << VIEW_INDEX_SHIFT) ? entries - k : 1 << VIEW_INDEX_SHIFT;
+        if (!v->index[k >> VIEW_INDEX_SHIFT]) {
+            v->index[k >> VIEW_INDEX_SHIFT] = (long long *)malloc(sizeof(long long) << VIEW_INDEX_SHIFT);
+        }
+        ok = fread(view_entry(v, k), sizeof(long long), (size_t)n, in) == (size_t)n;
+    }
+    fclose(in);
+    
+    if (!ok || v->index[0][0] != v->data_start) {
+        v->index[0][0] = v->data_start;
+        return 0;
+    }
+    v->indexed = entries;
+    v->lines = lines;
+    v->scanned = 1;
+    return 1;
+}
+
+// Count the lines of a paged file, indexing them as it goes, while the
+// UI thread shows what has been indexed so far
+static unsigned __stdcall view_scanner(void *arg) {
+    FileView *v = (FileView *)arg;
+    FILE *fp = fopen(v->path, "rb");
+    char *buf = (char *)malloc(VIEW_SCAN_BYTES);
+    long long at = v->data_start, line = 0, last = at;
+    int cr = 0;
+    
+    if (fp) {
+        _fseeki64(fp, at, SEEK_SET);
+        while (!v->stop && at < v->size) {
+            long long left = v->size - at;
+            size_t n = fread(buf, 1, left < VIEW_SCAN_BYTES ? (size_t)left : VIEW_SCAN_BYTES, fp);
+            if (n == 0) break;
+            
+            for (size_t i = 0; i < n; i++) {
+                if (cr) {
+                    // A CR ends a line, along with an LF right after it
+                    cr = 0;
+                    last = at + i + (buf[i] == '\n');
+                    view_mark(v, ++line, last);
+                    if (buf[i] == '\n') continue;
+                }
+                if ((unsigned char)buf[i] > '\r') continue;
+                if (buf[i] == '\n') {
+                    last = at + i + 1;
+                    view_mark(v, ++line, last);
+                } else if (buf[i] == '\r') {
+                    cr = 1;
+                }
+            }
+            at += n;
+        }
+        if (cr) {
+            last = at;
+            line++;
+        }
+    }
+    free(buf);
+    
+    v->lines = line + (at > last);
+    if (v->lines == 0) v->lines = 1;
+    if (fp) {
+        if (!v->stop && at == v->size && v->size >= INDEX_MIN_SIZE) save_index(v, fp);
+        fclose(fp);
+    }
+    
+    EnterCriticalSection(&v->lock);
+    v->scanned = 1;
+    LeaveCriticalSection(&v->lock);
+    return 0;
+}
+
+// Nearest indexed line at or before line; *from gets its number. While
+// the scanner hasn't got that far this is the last line it has indexed,
+// and the caller reads on from there rather than waiting for it.
+static long long view_indexed(FileView *v, long long line, long long *from) {
+    long long k = line / VIEW_INDEX_STEP, at;
+    
+    EnterCriticalSection(&v->lock);
+    if (k >= v->indexed) k = v->indexed - 1;
+    at = *view_entry(v, k);
+    LeaveCriticalSection(&v->lock);
+    *from = k * VIEW_INDEX_STEP;
+    return at;
+}
+
+// File offset where a line starts, reading on from the nearest indexed
+// line. A line past the end of the file becomes the last line.
+static long long view_seek(FileView *v, long long *line) {
+    long long from, at = view_indexed(v, *line, &from);
+    if (v->base <= *line && v->base > from) {
+        // The resident window starts nearer
+        from = v->base;
+        at = v->start;
+    }
+    long long want = *line - from, brk = at;
+    char *buf = (char *)malloc(VIEW_SCAN_BYTES);
+    
+    while (want > 0) {
+        long long left = v->size - at;
+        _fseeki64(v->fp, at, SEEK_SET);
+        long n = (long)fread(buf, 1, left < VIEW_SCAN_BYTES ? (size_t)left : VIEW_SCAN_BYTES, v->fp);
+        if (n <= 0) break;
+        
+        long long found;
+        long last;
+        int end = at + n >= v->size;
+        long used = line_breaks(buf, n, want, &found, &last, end);
+        if (found) brk = at + last;
+        want -= found;
+        at += used;
+        if (end) break;
+    }
+    free(buf);
+    
+    if (want > 0) {
+        // The file ends first: its last line starts at the last break,
+        // unless that is the very end
+        *line -= want;
+        if (brk >= v->size && *line > from) {
+            (*line)--;
+            return view_seek(v, line);
+        }
+        at = brk;
+    }
+    return at;
+}
+
+// Make the lines from base on the document's text in place of the window
+// held now, clamping base to the file. Anchors are left unset and the
+// cursor at the top.
+void view_load(Editor *ed, long long base) {
+    Document *doc = ed->doc;
+    FileView *v = doc->view;
+    long long start = view_seek(v, &base);
+    long cap = VIEW_WINDOW_BYTES, n = 0, len;
+    char *buf = (char *)malloc(cap);
+    
+    // Read whole lines, as many as fit, but enough to move about in
+    _fseeki64(v->fp, start, SEEK_SET);
+    for (;;) {
+        long long found;
+        long last, want = cap - n;
+        
+        if (want > v->size - start - n) want = (long)(v->size - start - n);
+        long got = (long)fread(&buf[n], 1, want, v->fp);
+        n += got;
+        int end = start + n >= v->size || got == 0;
+        len = line_breaks(buf, n, VIEW_WINDOW_LINES, &found, &last, end);
+        if (found == VIEW_WINDOW_LINES || end) break;
+        if (found >= VIEW_MIN_LINES) {
+            len = last;
+            break;
+        }
+        cap *= 2;
+        buf = (char *)realloc(buf, cap);
+    }
+    
+    Line *first;
+    int count, invalid;
+    if (!v->decoded) {
+        // The first window read tells the encoding, unless a BOM did
+        if (v->data_start) {
+            doc->file.encoding = ENC_UTF8;
+            first = split_lines(buf, len, &doc->file, &count, &invalid);
+        } else {
+            first = decode_file(buf, len, &doc->file, &count);
+        }
+        doc->file.bom = v->data_start > 0;
+        v->encoding = doc->file.encoding;
+        v->decoded = 1;
+    } else {
+        FileFormat ff = doc->file;
+        if (v->encoding == ENC_ANSI) {
+            long text_len;
+            char *text = convert_to_utf8(buf, len, ENC_ANSI, &text_len);
+            first = split_lines(text, text_len, &ff, &count, &invalid);
+            free(text);
+        } else {
+            first = split_lines(buf, len, &ff, &count, &invalid);
+        }
+    }
+    free(buf);
+    if (!first) {
+        first = create_line();
+        count = 1;
+    }
+    
+    Line *line = doc->first_line;
+    while (line) {
+        Line *next = line->next;
+        free_line(line);
+        line = next;
+    }
+    doc->first_line = NULL;
+    doc->line_count = 0;
+    clear_anchors(ed);
+    
+    Line *last = first;
+    while (last->next) last = last->next;
+    int journal_off = ed->journal_off;
+    ed->journal_off = 1;
+    link_lines(ed, NULL, first, last, count);
+    ed->journal_off = journal_off;
+    doc->current_line = doc->first_line;
+    doc->cursor_x = 0;
+    doc->modified = 0;
+    
+    v->base = base;
+    v->start = start;
+    v->end = start + len;
+}
+
+// Slide the window to start at base. The cursor, the view and any anchors
+// still resident stay on the same lines; other anchors are unset.
+void view_move(Editor *ed, long long base) {
+    Document *doc = ed->doc;
+    FileView *v = doc->view;
+    long long *spots = (long long *)malloc((doc->anchor_count + 1) * sizeof(long long));
+    int *cols = (int *)malloc((doc->anchor_count + 1) * sizeof(int));
+    long long old = v->base;
+    long long cur = old + get_line_number(ed, doc->current_line) - 1;
+    int x = doc->cursor_x;
+    
+    for (int i = 0; i < doc->anchor_count; i++) {
+        Anchor *a = doc->anchors[i];
+        spots[i] = a->line ? old + get_line_number(ed, a->line) - 1 : -1;
+        cols[i] = a->col;
+    }
+    
+    view_load(ed, base);
+    
+    for (int i = 0; i < doc->anchor_count; i++) {
+        long long row = spots[i] - v->base;
+        if (spots[i] >= 0 && row >= 0 && row < doc->line_count) {
+            doc->anchors[i]->line = get_line_at(ed, (int)row + 1);
+            doc->anchors[i]->col = cols[i];
+        }
+    }
+    free(spots);
+    free(cols);
+    if (!doc->block.start.line || !doc->block.end.line) {
+        doc->block.start.line = doc->block.end.line = NULL;
+        doc->block.active = 0;
+    }
+    
+    long long row = cur - v->base;
+    if (row < 0) row = 0;
+    if (row >= doc->line_count) row = doc->line_count - 1;
+    doc->current_line = get_line_at(ed, (int)row + 1);
+    doc->cursor_x = x < doc->current_line->length ? x : doc->current_line->length;
+    
+    long long top = ed->top_line + old - v->base;
+    if (top < 0 || top >= doc->line_count) {
+        top = top < 0 ? 0 : doc->line_count - 1;
+        ed->top_sub = 0;
+    }
+    ed->top_line = (int)top;
+}
+
+// Bring a line of a paged file into the window, a line past the end
+// being the last one. Returns where it is in the window, from 0.
+int view_goto(Editor *ed, long long target) {
+    Document *doc = ed->doc;
+    FileView *v = doc->view;
+    long long lead = VIEW_WINDOW_LINES / 2;
+    
+    if (target < 0) target = 0;
+    if (v->scanned && target >= v->lines) target = v->lines - 1;
+    while (target < v->base || target >= v->base + doc->line_count) {
+        if (target >= v->base && v->end >= v->size) {
+            // Past the end: the last line, with the lines before it resident
+            target = v->base + doc->line_count - 1;
+            if (target - v->base >= lead || v->base == 0) break;
+        }
+        view_move(ed, target > lead ? target - lead : 0);
+        // Lines too long for a window around the target: start nearer it
+        lead = doc->line_count / 4;
+    }
+    return (int)(target - v->base);
+}
+
+// Whether a line of a paged file can be found without reading far into
+// the file: the scanner has indexed up to it, or it is just past the window
+static int view_reachable(Editor *ed, long long line) {
+    FileView *v = ed->doc->view;
+    long long indexed;
+    
+    EnterCriticalSection(&v->lock);
+    indexed = v->indexed;
+    LeaveCriticalSection(&v->lock);
+    return v->scanned || line / VIEW_INDEX_STEP < indexed ||
+           (line >= v->base && line < v->base + ed->doc->line_count + VIEW_WINDOW_LINES);
+}
+
+// Put off a jump to line and column col (INT_MAX for its end) of a paged
+// file if the scanner hasn't indexed that far; view_jump() makes it once
+// it has. Returns 1 if put off.
+int view_defer(Editor *ed, long long line, int col) {
+    FileView *v = ed->doc->view;
+    
+    if (view_reachable(ed, line)) return 0;
+    v->pending = line;
+    v->pending_col = col;
+    update_status(ed, "Indexing - going there once it is reached");
+    return 1;
+}
+
+// Make the jump put off in the current paged file, if the scanner has
+// got to its line. Returns 1 if the cursor moved.
+int view_jump(Editor *ed) {
+    FileView *v = ed->doc->view;
+    
+    if (!v || v->pending < 0 || !view_reachable(ed, v->pending)) return 0;
+    Line *line = get_line_at(ed, view_goto(ed, v->pending) + 1);
+    ed->doc->current_line = line;
+    ed->doc->cursor_x = v->pending_col < line->length ? v->pending_col : line->length;
+    char msg[48];
+    snprintf(msg, sizeof(msg), "At line %lld", v->base + get_line_number(ed, line));
+    v->pending = -1;
+    update_status(ed, msg);
+    return 1;
+}
+
+// Slide the window when the cursor comes near an edge with more of the
+// file beyond it, keeping at least a screen of lines on either side
+void view_follow(Editor *ed) {
+    Document *doc = ed->doc;
+    FileView *v = doc->view;
+    
+    if (!v) return;
+    
+    int row = get_line_number(ed, doc->current_line);
+    int margin = doc->line_count / 4;
+    if (margin > VIEW_MARGIN) margin = VIEW_MARGIN;
+    if (margin < SCREEN_HEIGHT) margin = SCREEN_HEIGHT;
+    if (!(row <= margin && v->base > 0) && !(row > doc->line_count - margin && v->end < v->size)) {
+        return;
+    }
+    
+    long long cur = v->base + row - 1;
+    long long base = cur - (doc->line_count / 2 > margin ? doc->line_count / 2 : margin);
+    int x = doc->cursor_x;
+    
+    view_move(ed, base > 0 ? base : 0);
+    if (cur + margin >= v->base + doc->line_count && v->end < v->size) {
+        // The lines ahead are longer; start the window just a margin back
+        view_move(ed, cur > margin ? cur - margin : 0);
+        doc->current_line = get_line_at(ed, (int)(cur - v->base) + 1);
+        doc->cursor_x = x < doc->current_line->length ? x : doc->current_line->length;
+    }
+}
+
+// First place text of length m occurs in data, or NULL
+static const char *find_bytes(const char *data, long n, const char *text, int m) {
+    const char *p = data;
+    
+    if (n < m) return NULL;
+    while ((p = (const char *)memchr(p, text[0], data + n - m + 1 - p)) != NULL) {
+        if (memcmp(p, text, m) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+// Search a paged file's bytes from offset at, the start of line number
+// line, up to offset to, reading whole lines at a time. Sets *found and
+// *col to where the search text first occurs.
+int view_find(Editor *ed, long long at, long long line, long long to, long long *found, int *col) {
+    FileView *v = ed->doc->view;
+    const char *pattern = ed->find.find_text;
+    int m = strlen(pattern);
+    long cap = VIEW_SCAN_BYTES;
+    char *buf = (char *)malloc(cap);
+    int hit = 0;
+    
+    while (!hit && at < to) {
+        long want = to - at < cap ? (long)(to - at) : cap;
+        _fseeki64(v->fp, at, SEEK_SET);
+        long n = (long)fread(buf, 1, want, v->fp);
+        if (n <= 0) break;
+        
+        long long breaks;
+        long last;
+        int end = at + n >= to;
+        line_breaks(buf, n, LLONG_MAX, &breaks, &last, end);
+        long len = end ? n : last;
+        if (len == 0) {
+            // A line longer than the buffer
+            cap *= 2;
+            buf = (char *)realloc(buf, cap);
+            continue;
+        }
+        
+        const char *text = buf;
+        long text_len = len;
+        char *converted = NULL;
+        if (v->encoding == ENC_ANSI) {
+            converted = convert_to_utf8(buf, len, ENC_ANSI, &text_len);
+            text = converted;
+        }
+        
+        const char *p = find_bytes(text, text_len, pattern, m);
+        if (p) {
+            long long before;
+            long start;
+            line_breaks(text, p - text, LLONG_MAX, &before, &start, 1);
+            *found = line + before;
+            *col = (int)(p - text - start);
+            hit = 1;
+        }
+        free(converted);
+        
+        line += breaks;
+        at += len;
+    }
+    free(buf);
+    return hit;
+}
+
+// Open a file as a paged, read-only view instead of loading it. Returns 0
+// for UTF-16 files, which can't be paged by their line breaks.
+int open_view(Editor *ed, const char *filename) {
+    Document *doc = ed->doc;
+    unsigned char head[3];
+    FILE *fp = fopen(filename, "rb");
+    
+    if (!fp) return 0;
+    size_t n = fread(head, 1, 3, fp);
+    if (n >= 2 && ((head[0] == 0xFF && head[1] == 0xFE) || (head[0] == 0xFE && head[1] == 0xFF))) {
+        fclose(fp);
+        return 0;
+    }
+    
+    FileView *v = (FileView *)calloc(1, sizeof(FileView));
+    snprintf(v->path, MAX_PATH, "%s", filename);
+    v->fp = fp;
+    v->size = doc->disk_size;
+    v->mtime = doc->disk_time;
+    v->data_start = n == 3 && head[0] == 0xEF && head[1] == 0xBB && head[2] == 0xBF ? 3 : 0;
+    v->index[0] = (long long *)malloc(sizeof(long long) << VIEW_INDEX_SHIFT);
+    v->index[0][0] = v->data_start;
+    v->indexed = 1;
+    v->pending = -1;
+    InitializeCriticalSection(&v->lock);
+    if (!load_index(v)) {
+        v->thread = (HANDLE)_beginthreadex(NULL, 0, view_scanner, v, 0, NULL);
+    }
+    
+    strcpy(doc->filename, filename);
+    doc->view = v;
+    doc->block.active = 0;
+    view_load(ed, 0);
+    
+    char msg[80], name[32];
+    snprintf(msg, sizeof(msg), "Viewing - %s, read-only", format_name(&doc->file, name, sizeof(name)));
+    update_status(ed, msg);
+    return 1;
+}
+
+// Stop paging a document's file
+void close_view(Document *doc) {
+    FileView *v = doc->view;
+    if (!v) return;
+    
+    if (v->thread) {
+        InterlockedExchange(&v->stop, 1);
+        WaitForSingleObject(v->thread, INFINITE);
+        CloseHandle(v->thread);
+    }
+    DeleteCriticalSection(&v->lock);
+    fclose(v->fp);
+    for (int i = 0; i < VIEW_INDEX_BLOCKS && v->index[i]; i++) {
+        free(v->index[i]);
+    }
+    free(v);
+    doc->view = NULL;
+}
+
+// Count the line breaks of a scanned file from its last index entry on,
+// so lines added to the file can be indexed after them
+static void view_tail(FileView *v) {
+    long long from, at = view_indexed(v, LLONG_MAX, &from);
+    char *buf = (char *)malloc(VIEW_SCAN_BYTES);
+    
+    v->breaks = from;
+    v->tail = at;
+    while (at < v->size) {
+        long long left = v->size - at, found;
+        long last;
+        _fseeki64(v->fp, at, SEEK_SET);
+        long n = (long)fread(buf, 1, left < VIEW_SCAN_BYTES ? (size_t)left : VIEW_SCAN_BYTES, v->fp);
+        if (n <= 0) break;
+        
+        long used = line_breaks(buf, n, LLONG_MAX, &found, &last, at + n >= v->size);
+        if (found) v->tail = at + last;
+        v->breaks += found;
+        at += used;
+    }
+    free(buf);
+    v->counted = 1;
+}
+
+// Index whole lines added to the end of a paged file
+static void view_extend(FileView *v, const char *data, long len) {
+    long long at = v->size;
+    long i = 0;
+    
+    v->size += len;
+    // The line after the old last break may only just have begun
+    view_mark(v, v->breaks, v->tail);
+    while (i < len) {
+        long long found;
+        long last;
+        i += line_breaks(&data[i], len - i, 1, &found, &last, 1);
+        v->tail = at + i;
+        view_mark(v, ++v->breaks, v->tail);
+    }
+    v->lines = v->breaks;
+}
+
+// Whether a document's file can be followed: it must be on disk, and not
+// UTF-16, whose line breaks can't be found byte by byte
+int can_follow(Document *doc) {
+    return doc->disk_size >= 0 && doc->file.encoding != ENC_UTF16LE &&
+           doc->file.encoding != ENC_UTF16BE;
+}
+
+// Start or stop following a document's file. While followed, its folder
+// is watched so that growth is seen at once; the poll every
+// FOLLOW_POLL_MS still catches what the notification misses (NTFS may
+// not report a file's size until its writer flushes or closes it).
+void set_follow(Document *doc, int on) {
+    if (doc->watch) {
+        FindCloseChangeNotification(doc->watch);
+        doc->watch = NULL;
+    }
+    doc->follow = on;
+    if (!on) return;
+    
+    char dir[MAX_PATH];
+    char *slash = NULL;
+    strcpy(dir, doc->filename);
+    for (char *p = dir; *p; p++) {
+        if (*p == '\\' || *p == '/' || *p == ':') slash = p;
+    }
+    if (!slash) strcpy(dir, ".");
+    else if (*slash == ':' || slash == dir) slash[1] = '\0';  // C: or the root
+    else *slash = '\0';
+    
+    HANDLE h = FindFirstChangeNotification(dir, FALSE,
+                                           FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    doc->watch = h == INVALID_HANDLE_VALUE ? NULL : h;
+}
+
+// Start or stop taking in what is appended to the current file
+void toggle_follow(Editor *ed) {
+    Document *doc = ed->doc;
+    
+    if (doc->follow) {
+        set_follow(doc, 0);
+        update_status(ed, "Follow OFF");
+    } else if (!can_follow(doc)) {
+        update_status(ed, doc->disk_size < 0 ? "File not on disk" : "Can't follow UTF-16 files");
+    } else {
+        doc->follow_held = 0;
+        set_follow(doc, 1);
+        update_status(ed, "Follow ON");
+    }
+}
+
+// Add text read from the end of a followed file after the document's
+// last line, the first of its lines continuing that one if join is set.
+// The additions are the file's, so they leave the modified flag alone.
+static void follow_append(Editor *ed, const char *data, long len, Encoding encoding, int join) {
+    Document *doc = ed->doc;
+    FileFormat ff = doc->file;
+    char *converted = NULL;
+    int count, invalid;
+    
+    if (encoding == ENC_ANSI) {
+        converted = convert_to_utf8(data, len, ENC_ANSI, &len);
+        data = converted;
+    }
+    Line *first = split_lines(data, len, &ff, &count, &invalid);
+    free(converted);
+    if (!first) return;
+    
+    Line *last = get_line_at(ed, doc->line_count);
+    int modified = doc->modified;
+    int journal_off = ed->journal_off;
+    ed->journal_off = 1;
+    if (join) {
+        insert_string(ed, last, last->length, first->text, first->length, NULL, NULL);
+        Line *rest = first->next;
+        free_line(first);
+        first = rest;
+        count--;
+    }
+    if (first) {
+        Line *end = first;
+        while (end->next) end = end->next;
+        first->prev = NULL;
+        link_lines(ed, last, first, end, count);
+    }
+    ed->journal_off = journal_off;
+    doc->modified = modified;
+}
+
+// Take in the whole lines added to a followed file since it was last
+// read, without reloading it. Cursors on the last line move on to the
+// new last line; everything else stays where it is. A paged file only
+// gets the lines in its window if the window reaches the old end.
+// Returns 1 if the screen needs redrawing.
+int follow_file(Editor *ed) {
+    Document *doc = ed->doc;
+    FileView *v = doc->view;
+    long long at = doc->disk_size - doc->follow_held, size, mtime;
+    
+    if (doc->save || (v && !v->scanned)) return 0;
+    file_stamp(doc->filename, &size, &mtime);
+    if (size == doc->disk_size && mtime == doc->disk_time) return 0;
+    if (size < at) {
+        set_follow(doc, 0);
+        update_status(ed, "File got shorter - Follow OFF");
+        return 1;
+    }
+    
+    FILE *fp = v ? v->fp : fopen(doc->filename, "rb");
+    if (!fp) return 0;
+    long cap = FOLLOW_READ_BYTES, n = 0, len;
+    char *buf = (char *)malloc(cap);
+    for (;;) {
+        long long found;
+        long want = size - at - n < cap - n ? (long)(size - at - n) : cap - n;
+        _fseeki64(fp, at + n, SEEK_SET);
+        long got = (long)fread(&buf[n], 1, want, fp);
+        n += got;
+        line_breaks(buf, n, LLONG_MAX, &found, &len, 0);
+        if (found || got == 0 || at + n >= size) break;
+        // A line longer than the buffer
+        cap *= 2;
+        buf = (char *)realloc(buf, cap);
+    }
+    if (!v) fclose(fp);
+    // The stamp is the file as it is, with any partial last line held
+    // back until its line break arrives
+    doc->disk_size = size;
+    doc->disk_time = mtime;
+    doc->disk_sample = file_sample(doc->filename, size);
+    doc->follow_held = size - at - len;
+    if (len == 0) {
+        // Nothing but the start of a line yet
+        free(buf);
+        return 0;
+    }
+    
+    Line *last = get_line_at(ed, doc->line_count);
+    int resident = !v || v->end >= at;
+    int join = v ? v->tail < at : !doc->file.final_newline;
+    
+    if (v) {
+        if (!v->counted) view_tail(v);
+        view_extend(v, buf, len);
+    }
+    if (resident) {
+        follow_append(ed, buf, len, v ? v->encoding : doc->file.encoding, join);
+        if (v) v->end = v->size;
+    }
+    free(buf);
+    doc->file.final_newline = 1;
+    if (doc->journal) {
+        // Unsaved edits still apply to the grown file, whose new lines come
+        // after them; restamp the journal so it can be recovered over it,
+        // and keep a joined last line as the buffer has it
+        rebase_journal(ed, doc, -1);
+        if (join) journal_text(ed, last, 0);
+        commit_journals(ed);
+    }
+    if (!resident) return 1;
+    
+    // Keep following the end
+    Line *end = get_line_at(ed, doc->line_count);
+    if (doc->current_line == last) {
+        doc->current_line = end;
+        doc->cursor_x = 0;
+    }
+    for (int i = 0; i < ed->pane_count; i++) {
+        Pane *pane = &ed->panes[i];
+        if (i == ed->pane || pane->doc != doc || pane->cursor.line != last) continue;
+        pane->cursor.line = end;
+        pane->cursor.col = 0;
+        int top = doc->line_count - pane->rows + 1;
+        pane->top.line = get_line_at(ed, top > 1 ? top : 1);
+        pane->top_sub = 0;
+    }
+    
+    if (v && (doc->line_count > VIEW_WINDOW_LINES || v->end - v->start > VIEW_WINDOW_BYTES)) {
+        // Let go of lines left far behind
+        long long cur = v->base + get_line_number(ed, doc->current_line) - 1;
+        view_move(ed, cur > VIEW_MARGIN ? cur - VIEW_MARGIN : 0);
+    }
+    return 1;
+}
+
+// Check every followed file for growth. A paged file is only followed
+// while it is the one being edited, as its window slides with the view.
+int follow_files(Editor *ed) {
+    Document *active = ed->doc;
+    int changed = 0;
+    
+    for (int i = 0; i < ed->doc_count; i++) {
+        Document *doc = ed->docs[i];
+        if (!doc->follow || (doc->view && doc != active)) continue;
+        
+        ed->doc = doc;
+        changed |= follow_file(ed);
+        ed->doc = active;
+    }
+    if (changed) scroll_to_cursor(ed);
+    return changed;
+}
+
+// Files being followed
+int files_followed(Editor *ed) {
+    int count = 0;
+    
+    for (int i = 0; i < ed->doc_count; i++) {
+        if (ed->docs[i]->follow) count++;
+    }
+    return count;
+}
+
+// Put the change notifications of followed files in handles, up to room
+// of them. Returns how many there are.
+int follow_handles(Editor *ed, HANDLE *handles, int room) {
+    int count = 0;
+    
+    for (int i = 0; i < ed->doc_count && count < room; i++) {
+        if (ed->docs[i]->follow && ed->docs[i]->watch) handles[count++] = ed->docs[i]->watch;
+    }
+    return count;
+}
+
+// Hash of a line's text, for comparing lines
+unsigned long long line_hash(const char *text, int len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Find a point on a shortest edit path between a[xoff..xlim) and
+// b[yoff..ylim), searching from both ends until the paths meet (Myers'
+// middle snake). After DIFF_MAX_COST steps, settle for the point either
+// search got furthest to.
+static void diff_split(DiffRun *r, int xoff, int xlim, int yoff, int ylim, int *xmid, int *ymid) {
+    int *fd = r->fd, *bd = r->bd;
+    int dmin = xoff - ylim, dmax = xlim - yoff;
+    int fmid = xoff - yoff, bmid = xlim - ylim;
+    int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    int odd = (fmid - bmid) & 1;
+    
+    fd[fmid] = xoff;
+    bd[bmid] = xlim;
+    for (int c = 1;; c++) {
+        if (fmin > dmin) fd[--fmin - 1] = -1; else fmin++;
+        if (fmax < dmax) fd[++fmax + 1] = -1; else fmax--;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int x = fd[d - 1] >= fd[d + 1] ? fd[d - 1] + 1 : fd[d + 1], y = x - d;
+            while (x < xlim && y < ylim && r->a[x] == r->b[y]) {
+                x++;
+                y++;
+            }
+            fd[d] = x;
+            if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+                *xmid = x;
+                *ymid = y;
+                return;
+            }
+        }
+        
+        if (bmin > dmin) bd[--bmin - 1] = INT_MAX; else bmin++;
+        if (bmax < dmax) bd[++bmax + 1] = INT_MAX; else bmax--;
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int x = bd[d - 1] < bd[d + 1] ? bd[d - 1] : bd[d + 1] - 1, y = x - d;
+            while (x > xoff && y > yoff && r->a[x - 1] == r->b[y - 1]) {
+                x--;
+                y--;
+            }
+            bd[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+                *xmid = x;
+                *ymid = y;
+                return;
+            }
+        }
+        
+        if (c < DIFF_MAX_COST) continue;
+        
+        // Too far apart for the best path: split where the search has
+        // matched the most lines
+        int fxy = -1, fx = xoff, bxy = INT_MAX, bx = xlim;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int x = fd[d] < xlim ? fd[d] : xlim, y = x - d;
+            if (y > ylim) {
+                x = ylim + d;
+                y = ylim;
+            }
+            if (x + y > fxy) {
+                fxy = x + y;
+                fx = x;
+            }
+        }
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int x = bd[d] > xoff ? bd[d] : xoff, y = x - d;
+            if (y < yoff) {
+                x = yoff + d;
+                y = yoff;
+            }
+            if (x + y < bxy) {
+                bxy = x + y;
+                bx = x;
+            }
+        }
+        if (xlim + ylim - bxy < fxy - (xoff + yoff)) {
+            *xmid = fx;
+            *ymid = fxy - fx;
+        } else {
+            *xmid = bx;
+            *ymid = bxy - bx;
+        }
+        return;
+    }
+}
+
+// Mark the lines of a[xoff..xlim) and b[yoff..ylim) left out of a
+// longest common run, splitting the problem at middle snakes
+static void diff_compare(DiffRun *r, int xoff, int xlim, int yoff, int ylim) {
+    for (;;) {
+        while (xoff < xlim && yoff < ylim && r->a[xoff] == r->b[yoff]) {
+            xoff++;
+            yoff++;
+        }
+        while (xlim > xoff && ylim > yoff && r->a[xlim - 1] == r->b[ylim - 1]) {
+            xlim--;
+            ylim--;
+        }
+        
+        int xmid = xoff, ymid = yoff;
+        if (xoff < xlim && yoff < ylim) diff_split(r, xoff, xlim, yoff, ylim, &xmid, &ymid);
+        if ((xmid == xoff && ymid == yoff) || (xmid == xlim && ymid == ylim)) {
+            memset(&r->a_changed[xoff], 1, xlim - xoff);
+            memset(&r->b_changed[yoff], 1, ylim - yoff);
+            return;
+        }
+        
+        // Recurse into the smaller half, so the stack stays shallow
+        if (xmid - xoff + ymid - yoff < xlim - xmid + ylim - ymid) {
+            diff_compare(r, xoff, xmid, yoff, ymid);
+            xoff = xmid;
+            yoff = ymid;
+        } else {
+            diff_compare(r, xmid, xlim, ymid, ylim);
+            xlim = xmid;
+            ylim = ymid;
+        }
+    }
+}
+
+// Compare two runs of line hashes, setting a_changed for the lines of a
+// that b doesn't have and b_changed for the lines b adds. Space is linear
+// and time O((n + m) D) for D differences; where they are dense, each
+// split is settled after DIFF_MAX_COST steps, so the changes marked may
+// then be more than the fewest possible.
+void diff_lines(const unsigned long long *a, int n, const unsigned long long *b, int m,
+                char *a_changed, char *b_changed) {
+    DiffRun r;
+    int diags = n + m + 3;
+    int *buf = (int *)malloc(2 * (size_t)diags * sizeof(int));
+    
+    r.a = a;
+    r.b = b;
+    r.a_changed = a_changed;
+    r.b_changed = b_changed;
+    r.fd = buf + m + 1;
+    r.bd = buf + diags + m + 1;
+    
+    memset(a_changed, 0, n);
+    memset(b_changed, 0, m);
+    diff_compare(&r, 0, n, 0, m);
+    free(buf);
+}
+
+// Whether something else changed the file since the document was last
+// loaded or saved: its size, time or the bytes at its ends differ. A file
+// that has gone is not counted.
+int disk_changed(Document *doc) {
+    long long size, mtime;
+    
+    file_stamp(doc->filename, &size, &mtime);
+    return size >= 0 && (size != doc->disk_size || mtime != doc->disk_time ||
+                         file_sample(doc->filename, size) != doc->disk_sample);
+}
+
+// Offer to reload the file being edited if it changed on disk. Each
+// change is asked about once. Returns 1 if anything was said.
+int check_disk(Editor *ed) {
+    Document *doc = ed->doc;
+    long long size, mtime;
+    
+    if (ed->state != STATE_NORMAL || doc->view || doc->follow || doc->save || doc->disk_size < 0) {
+        return 0;
+    }
+    file_stamp(doc->filename, &size, &mtime);
+    unsigned long long sample = file_sample(doc->filename, size);
+    if ((size == doc->disk_size && mtime == doc->disk_time && sample == doc->disk_sample) ||
+        (size == doc->asked_size && mtime == doc->asked_time && sample == doc->asked_sample)) {
+        return 0;
+    }
+    doc->asked_size = size;
+    doc->asked_time = mtime;
+    doc->asked_sample = sample;
+    
+    if (size < 0) {
+        update_status(ed, "File deleted on disk");
+    } else {
+        ask_confirm(ed, CONFIRM_RELOAD, doc->modified ?
+                    "File changed on disk - reload it, losing your changes? (Y/N)" :
+                    "File changed on disk - reload it? (Y/N)");
+    }
+    return 1;
+}
+
+// Rewrite a line to have another line's text, replacing only the part
+// between what they have in common at each end
+static void rewrite_line(Editor *ed, Line *line, Line *to) {
+    const char *text = line_peek(line);
+    int head = 0, tail = 0;
+    
+    while (head < line->length && head < to->length && text[head] == to->text[head]) head++;
+    while (tail < line->length - head && tail < to->length - head &&
+           text[line->length - 1 - tail] == to->text[to->length - 1 - tail]) {
+        tail++;
+    }
+    if (head == line->length && head == to->length) return;
+    replace_range(ed, line, head, line, line->length - tail, &to->text[head],
+                  to->length - head - tail, NULL, NULL);
+}
+
+// Bring the document into line with its file as changed on disk without
+// reloading it: the file's lines are matched against the document's by
+// hash, and only the runs that differ are rewritten in place, dropped or
+// added. Cursors, markers and blocks on lines that didn't change stay
+// where they are.
+void reload_file(Editor *ed) {
+    Document *doc = ed->doc;
+    FileFormat ff = doc->file;
+    long long disk_size, disk_time;
+    long size;
+    int count;
+    
+    finish_save(ed, doc);
+    file_stamp(doc->filename, &disk_size, &disk_time);
+    unsigned long long disk_sample = file_sample(doc->filename, disk_size);
+    char *data = read_file_data(doc->filename, &size);
+    if (!data) {
+        update_status(ed, "Error: Cannot read file");
+        return;
+    }
+    Line *first = decode_file(data, size, &ff, &count);
+    free(data);
+    if (count < 0) {
+        update_status(ed, "Error: File too big to load");
+        return;
+    }
+    if (!first) {
+        first = create_line();
+        count = 1;
+    }
+    
+    int n = doc->line_count, m = count;
+    unsigned long long *a = (unsigned long long *)malloc(n * sizeof(unsigned long long));
+    unsigned long long *b = (unsigned long long *)malloc(m * sizeof(unsigned long long));
+    char *a_changed = (char *)malloc(n);
+    char *b_changed = (char *)malloc(m);
+    int i = 0, j = 0;
+    for (Line *line = doc->first_line; line; line = line->next) {
+        a[i++] = line_hash(line_peek(line), line->length);
+    }
+    for (Line *line = first; line; line = line->next) {
+        b[j++] = line_hash(line->text, line->length);
+    }
+    diff_lines(a, n, b, m, a_changed, b_changed);
+    
+    int journal_off = ed->journal_off;
+    ed->journal_off = 1;
+    Line *old = doc->first_line, *prev = NULL, *line = first;
+    int changed = 0;
+    i = j = 0;
+    while (i < n || j < m) {
+        int del = 0, add = 0;
+        while (i + del < n && a_changed[i + del]) del++;
+        while (j + add < m && b_changed[j + add]) add++;
+        if (!del && !add) {
+            if (i == n || j == m) break;
+            // The same line, unless the hashes only collide
+            del = add = 1;
+        } else {
+            changed += del > add ? del : add;
+        }
+        
+        // Lines that changed are rewritten where they are
+        for (; del && add; del--, add--, i++, j++) {
+            Line *next = line->next;
+            rewrite_line(ed, old, line);
+            free_line(line);
+            line = next;
+            prev = old;
+            old = old->next;
+        }
+        if (add) {
+            Line *last = line;
+            for (int k = 1; k < add; k++) last = last->next;
+            Line *next = last->next;
+            last->next = NULL;
+            if (next) next->prev = NULL;
+            link_lines(ed, prev, line, last, add);
+            prev = last;
+            line = next;
+            j += add;
+        }
+        if (del) {
+            Line *last = old;
+            for (int k = 1; k < del; k++) last = last->next;
+            Line *next = last->next;
+            unlink_lines(ed, old, last, del);
+            while (old) {
+                Line *following = old->next;
+                free_line(old);
+                old = following;
+            }
+            old = next;
+            i += del;
+        }
+    }
+    ed->journal_off = journal_off;
+    free(a);
+    free(b);
+    free(a_changed);
+    free(b_changed);
+    
+    // The document is the file again
+    doc->file = ff;
+    doc->modified = 0;
+    doc->disk_size = disk_size;
+    doc->disk_time = disk_time;
+    doc->disk_sample = disk_sample;
+    doc->follow_held = 0;
+    close_journal(doc, 1);
+    if (doc->cursor_x > doc->current_line->length) doc->cursor_x = doc->current_line->length;
+    
+    char msg[80];
+    if (changed) {
+        snprintf(msg, sizeof(msg), "Reloaded - %d lines changed", changed);
+    } else {
+        snprintf(msg, sizeof(msg), "Reloaded - no lines changed");
+    }
+    update_status(ed, msg);
+}
+
+// Ask a question answered with Y or N
+void ask_confirm(Editor *ed, Confirm confirm, const char *question) {
+    ed->state = STATE_CONFIRM;
+    ed->confirm = confirm;
+    update_status(ed, question);
+}
+
+// Ask before a save would overwrite changes made to the file on disk.
+// Returns 1 if asked; the save then waits for the answer.
+int ask_overwrite(Editor *ed, Confirm confirm) {
+    if (ed->batch || !disk_changed(ed->doc)) return 0;
+    ask_confirm(ed, confirm, "File changed on disk - overwrite it? (Y/N)");
+    return 1;
+}
+
+// Hashes of a document's lines
+static unsigned long long *hash_lines(Line *first, int count) {
+    unsigned long long *hashes = (unsigned long long *)malloc(count * sizeof(unsigned long long));
+    int i = 0;
+    
+    for (Line *line = first; line && i < count; line = line->next) {
+        hashes[i++] = line_hash(line_peek(line), line->length);
+    }
+    return hashes;
+}
+
+// Set the compare marks of count lines from first: DIFF_LINE on the lines
+// changed says differ, and DIFF_GAP on the line (or the last line) where
+// the other side, with its own changed flags, has lines in addition
+static int mark_lines(Line *first, int count, const char *changed, const char *other, int other_count) {
+    Line *line = first, *last = first;
+    int i = 0, j = 0, hunks = 0;
+    
+    for (Line *l = first; l; l = l->next) l->diff = 0;
+    while (i < count || j < other_count) {
+        int del = 0, add = 0;
+        while (i + del < count && changed[i + del]) del++;
+        while (j + add < other_count && other[j + add]) add++;
+        if (!del && !add) {
+            if (i == count || j == other_count) break;
+            last = line;
+            line = line->next;
+            i++;
+            j++;
+            continue;
+        }
+        
+        hunks++;
+        if (!del) (line ? line : last)->diff |= DIFF_GAP;
+        for (; del; del--, i++) {
+            line->diff |= DIFF_LINE;
+            last = line;
+            line = line->next;
+        }
+        j += add;
+    }
+    return hunks;
+}
+
+// Compare the current document with another: a buffer named by its
+// number, a file, or with no name the document's own file on disk. The
+// lines are compared by hash, and those that differ are marked on both
+// sides for drawing and for ^QN and ^QP.
+void compare_with(Editor *ed, const char *name) {
+    Document *doc = ed->doc, *other = NULL;
+    Line *first = NULL;
+    int count, num = atoi(name);
+    char msg[80];
+    
+    if (name[0] && strspn(name, "0123456789") == strlen(name) && num >= 1 && num <= ed->doc_count) {
+        other = ed->docs[num - 1];
+        if (other == doc) {
+            update_status(ed, "That is this buffer");
+            return;
+        }
+    }
+    if (doc->view || (other && other->view)) {
+        update_status(ed, "Can't compare paged files");
+        return;
+    }
+    
+    if (other) {
+        first = other->first_line;
+        count = other->line_count;
+    } else {
+        FileFormat ff = doc->file;
+        long size;
+        char *data = read_file_data(name[0] ? name : doc->filename, &size);
+        if (!data) {
+            update_status(ed, "Error: Cannot read file");
+            return;
+        }
+        first = decode_file(data, size, &ff, &count);
+        free(data);
+        if (count < 0) {
+            update_status(ed, "Error: File too big to load");
+            return;
+        }
+        if (!first) {
+            first = create_line();
+            count = 1;
+        }
+    }
+    
+    int n = doc->line_count, m = count;
+    unsigned long long *a = hash_lines(doc->first_line, n);
+    unsigned long long *b = hash_lines(first, m);
+    char *a_changed = (char *)malloc(n);
+    char *b_changed = (char *)malloc(m);
+    diff_lines(a, n, b, m, a_changed, b_changed);
+    
+    stop_compare(ed);
+    int hunks = mark_lines(doc->first_line, n, a_changed, b_changed, m);
+    doc->compared = 1;
+    if (other) {
+        mark_lines(other->first_line, m, b_changed, a_changed, n);
+        other->compared = 1;
+    } else {
+        while (first) {
+            Line *next = first->next;
+            free_line(first);
+            first = next;
+        }
+    }
+    
+    int here = 0, there = 0;
+    for (int i = 0; i < n; i++) here += a_changed[i];
+    for (int j = 0; j < m; j++) there += b_changed[j];
+    free(a);
+    free(b);
+    free(a_changed);
+    free(b_changed);
+    
+    if (!hunks) {
+        update_status(ed, "No differences");
+        return;
+    }
+    doc->current_line = doc->first_line;
+    doc->cursor_x = 0;
+    if (!doc->first_line->diff) next_difference(ed, 0);
+    snprintf(msg, sizeof(msg), "%d differences: %d lines here, %d %s", hunks, here, there,
+             other ? "in the other buffer" : "in the file");
+    update_status(ed, msg);
+}
+
+// Stop showing compare marks in every buffer
+void stop_compare(Editor *ed) {
+    for (int i = 0; i < ed->doc_count; i++) {
+        ed->docs[i]->compared = 0;
+    }
+}
+
+// Whether a line begins a run of differences
+static int diff_starts(Line *line) {
+    return line->diff && ((line->diff & DIFF_GAP) || !line->prev || !(line->prev->diff & DIFF_LINE));
+}
+
+// Move to the start of the next difference after the cursor, or with
+// back set the one before it
+void next_difference(Editor *ed, int back) {
+    Document *doc = ed->doc;
+    Line *line = doc->current_line;
+    char msg[80];
+    
+    if (!doc->compared) {
+        update_status(ed, "Not comparing - ^OD compares");
+        return;
+    }
+    
+    // Leave the difference the cursor is in, then find the next one
+    while (!diff_starts(line) && line->prev && (line->diff & DIFF_LINE)) line = line->prev;
+    do {
+        line = back ? line->prev : line->next;
+    } while (line && !diff_starts(line));
+    if (!line) {
+        update_status(ed, back ? "No earlier difference" : "No more differences");
+        return;
+    }
+    
+    doc->current_line = line;
+    doc->cursor_x = 0;
+    
+    int index = 0, total = 0;
+    for (Line *l = doc->first_line; l; l = l->next) {
+        if (!diff_starts(l)) continue;
+        total++;
+        if (l->order <= line->order) index++;
+    }
+    snprintf(msg, sizeof(msg), "Difference %d of %d", index, total);
+    update_status(ed, msg);
+}
+
+// Handle the answer to a question
+void handle_confirm(Editor *ed, KEY_EVENT_RECORD *key) {
+    int yes = toupper(key_char(key)) == 'Y';
+    
+    ed->state = STATE_NORMAL;
+    switch (ed->confirm) {
+        case CONFIRM_RELOAD:
+            if (yes) {
+                reload_file(ed);
+            } else {
+                update_status(ed, "Not reloaded - ^KS will ask before overwriting");
+            }
+            break;
+        case CONFIRM_OVERWRITE:
+            if (yes) {
+                start_save(ed);
+            } else {
+                update_status(ed, "Not saved");
+            }
+            break;
+        case CONFIRM_EXIT:
+            if (yes) {
+                save_file(ed);
+                close_buffer(ed, 0);
+            } else {
+                update_status(ed, "Not saved");
+            }
+            break;
+    }
+}
+
+// Name of the journal kept for a file
+void journal_path(const char *filename, char *path) {
+    snprintf(path, MAX_PATH, "%s%s", filename, JOURNAL_EXT);
+}
+
+// Append records to the file as the UI thread hands them over, syncing at
+// most every JOURNAL_SYNC_MS so typing never waits on the disk
+static unsigned __stdcall journal_writer(void *arg) {
+    Journal *j = (Journal *)arg;
+    char *out = NULL;
+    int out_cap = 0;
+    int unsynced = 0;
+    DWORD last_sync = GetTickCount();
+    
+    for (;;) {
+        WaitForSingleObject(j->wake, JOURNAL_SYNC_MS);
+        
+        // Swap buffers so the UI thread can keep appending
+        EnterCriticalSection(&j->lock);
+        char *data = j->pending;
+        int len = j->pending_len;
+        int cap = j->pending_cap;
+        j->pending = out;
+        j->pending_len = 0;
+        j->pending_cap = out_cap;
+        int stop = j->stop;
+        LeaveCriticalSection(&j->lock);
+        out = data;
+        out_cap = cap;
+        
+        if (len) {
+            fwrite(out, 1, len, j->fp);
+            fflush(j->fp);
+            unsynced = 1;
+        }
+        if (unsynced && (stop || GetTickCount() - last_sync >= JOURNAL_SYNC_MS)) {
+            _commit(_fileno(j->fp));
+            last_sync = GetTickCount();
+            unsynced = 0;
+        }
+        if (stop) break;
+    }
+    
+    free(out);
+    return 0;
+}
+
+// Start journaling a document. With keep < 0 the journal starts afresh
+// with a header naming the file it applies to; otherwise the existing
+// journal is cut to keep bytes and appended to.
+Journal *open_journal(Document *doc, long keep) {
+    Journal *j = (Journal *)calloc(1, sizeof(Journal));
+    
+    journal_path(doc->filename, j->path);
+    j->fp = fopen(j->path, keep < 0 ? "wb" : "ab");
+    if (!j->fp) {
+        free(j);
+        return NULL;
+    }
+    if (keep < 0) {
+        fprintf(j->fp, "WSJ1 %lld %lld\n", doc->disk_size, doc->disk_time);
+        fflush(j->fp);
+        j->written = ftell(j->fp);
+    } else {
+        _chsize(_fileno(j->fp), keep);
+        j->written = keep;
+    }
+    
+    j->last_text = -1;
+    InitializeCriticalSection(&j->lock);
+    j->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    j->thread = (HANDLE)_beginthreadex(NULL, 0, journal_writer, j, 0, NULL);
+    return j;
+}
+
+// Stop journaling a document, once it is saved or abandoned
+void close_journal(Document *doc, int remove_file) {
+    Journal *j = doc->journal;
+    if (!j) return;
+    
+    EnterCriticalSection(&j->lock);
+    j->stop = 1;
+    LeaveCriticalSection(&j->lock);
+    SetEvent(j->wake);
+    WaitForSingleObject(j->thread, INFINITE);
+    CloseHandle(j->thread);
+    CloseHandle(j->wake);
+    DeleteCriticalSection(&j->lock);
+    
+    fclose(j->fp);
+    if (remove_file) remove(j->path);
+    free(j->buf);
+    free(j->pending);
+    free(j);
+    doc->journal = NULL;
+}
+
+// The journal for edits to the current document, opened by the first
+// edit since the file was loaded or saved; NULL when not journaling
+Journal *edit_journal(Editor *ed) {
+    Document *doc = ed->doc;
+    
+    if (ed->journal_off) return NULL;
+    if (!doc->journal && !doc->journal_failed) {
+        doc->journal = open_journal(doc, -1);
+        doc->journal_failed = !doc->journal;
+    }
+    return doc->journal;
+}
+
+// Add bytes to the records being collected
+static void journal_put(Journal *j, const char *data, int len) {
+    if (j->len + len > j->cap) {
+        j->cap = j->cap ? j->cap * 2 : 4096;
+        if (j->cap < j->len + len) j->cap = j->len + len;
+        j->buf = (char *)realloc(j->buf, j->cap);
+    }
+    memcpy(&j->buf[j->len], data, len);
+    j->len += len;
+}
+
+// Record a line's new text: "T line length", then the text. num is the
+// line number, or 0 to look it up. Repeated changes to one line between
+// other records keep only the last text.
+void journal_text(Editor *ed, Line *line, int num) {
+    Journal *j = edit_journal(ed);
+    char head[40];
+    if (!j) return;
+    
+    if (!num) num = get_line_number(ed, line);
+    line_warm(line);
+    if (j->last_text >= 0 && j->last_text_line == num) j->len = j->last_text;
+    j->last_text = j->len;
+    j->last_text_line = num;
+    
+    journal_put(j, head, sprintf(head, "T %d %d\n", num, line->length));
+    journal_put(j, line->text, line->length);
+    journal_put(j, "\n", 1);
+}
+
+// Record count lines inserted after line num ('I', followed by their
+// text) or deleted starting at line num ('D')
+void journal_lines(Editor *ed, char op, int num, Line *first, int count) {
+    Journal *j = ed->doc->journal;
+    char head[40];
+    
+    journal_put(j, head, sprintf(head, "%c %d %d\n", op, num, count));
+    j->last_text = -1;
+    
+    for (Line *line = first; line && count > 0; line = line->next, count--) {
+        journal_text(ed, line, ++num);
+    }
+}
+
+// Queue bytes for the writer thread to append
+static void journal_hand_over(Journal *j, const char *data, int len) {
+    EnterCriticalSection(&j->lock);
+    if (j->pending_len + len > j->pending_cap) {
+        j->pending_cap = j->pending_len + len + 4096;
+        j->pending = (char *)realloc(j->pending, j->pending_cap);
+    }
+    memcpy(&j->pending[j->pending_len], data, len);
+    j->pending_len += len;
+    LeaveCriticalSection(&j->lock);
+    SetEvent(j->wake);
+    j->written += len;
+}
+
+// Hand each document's records to its writer, ending the batch with a
+// commit mark so recovery never applies half an edit
+void commit_journals(Editor *ed) {
+    for (int i = 0; i < ed->doc_count; i++) {
+        Journal *j = ed->docs[i]->journal;
+        if (!j || j->len == 0) continue;
+        
+        journal_put(j, ".\n", 2);
+        journal_hand_over(j, j->buf, j->len);
+        
+        j->len = 0;
+        j->last_text = -1;
+    }
+}
+
+// Start the journal afresh for the file as just saved, carrying over the
+// records from mark on: the edits made while the save was running
+void rebase_journal(Editor *ed, Document *doc, long mark) {
+    char path[MAX_PATH];
+    long size;
+    if (!doc->journal) return;
+    
+    commit_journals(ed);
+    strcpy(path, doc->journal->path);
+    close_journal(doc, 0);
+    char *data = read_file_data(path, &size);
+    remove(path);
+    
+    // With no journal at the snapshot, every record is newer than it
+    if (data && mark < 0) {
+        const char *nl = (const char *)memchr(data, '\n', size);
+        mark = nl ? (long)(nl + 1 - data) : size;
+    }
+    
+    doc->journal = open_journal(doc, -1);
+    doc->journal_failed = !doc->journal;
+    if (doc->journal && data && mark < size) {
+        journal_hand_over(doc->journal, &data[mark], (int)(size - mark));
+    }
+    free(data);
+}
+
+// Read the head of the journal record at pos: op, line number and count.
+// Returns its length, or 0 if there is no complete record there.
+static int journal_record(const char *data, long pos, long size, char *op, int *num, int *count) {
+    char *end;
+    const char *nl = (const char *)memchr(&data[pos], '\n', size - pos);
+    if (!nl) return 0;
+    
+    *op = data[pos];
+    *num = (int)strtol(&data[pos + 1], &end, 10);
+    *count = (int)strtol(end, &end, 10);
+    if (end != nl || (*op != 'T' && *op != 'I' && *op != 'D')) return 0;
+    
+    int len = (int)(nl + 1 - &data[pos]);
+    if (*op == 'T') {
+        if (*count < 0 || pos + len + *count + 1 > size || data[pos + len + *count] != '\n') return 0;
+    }
+    return len;
+}
+
+// Replay the journal left by a session that didn't save, if it was kept
+// for the file as it is now. Only whole batches up to the last commit mark
+// are applied, and journaling continues in the same file.
+void recover_journal(Editor *ed) {
+    Document *doc = ed->doc;
+    char path[MAX_PATH];
+    long size;
+    long long jsize, jtime;
+    int header = 0, edits = 0, last_line = 1;
+    
+    // Batch runs keep no journal, and must not take in an interactive one
+    if (ed->batch || ed->journal_off) return;
+    journal_path(doc->filename, path);
+    char *data = read_file_data(path, &size);
+    if (!data) return;
+    data[size] = '\0';
+    
+    if (sscanf(data, "WSJ1 %lld %lld%n", &jsize, &jtime, &header) < 2 || data[header] != '\n' ||
+        jsize != doc->disk_size || jtime != doc->disk_time) {
+        // Move it aside, as the first edit starts a new journal in its place
+        char old[MAX_PATH + 8], msg[80 + MAX_PATH];
+        snprintf(old, sizeof(old), "%s.old", path);
+        remove(old);
+        if (rename(path, old) == 0) {
+            snprintf(msg, sizeof(msg), "Journal is for another version of the file - kept as %s", old);
+        } else {
+            snprintf(msg, sizeof(msg), "Journal is for another version of the file - not recovered");
+            doc->journal_failed = 1;
+        }
+        update_status(ed, msg);
+        free(data);
+        return;
+    }
+    header++;
+    
+    // Find the end of the last complete batch
+    long pos = header, good = header;
+    while (pos < size) {
+        char op;
+        int num, count;
+        
+        if (data[pos] == '.' && pos + 1 < size && data[pos + 1] == '\n') {
+            pos += 2;
+            good = pos;
+            continue;
+        }
+        int n = journal_record(data, pos, size, &op, &num, &count);
+        if (!n) break;
+        pos += n + (op == 'T' ? count + 1 : 0);
+    }
+    
+    int journal_off = ed->journal_off;
+    ed->journal_off = 1;
+    pos = header;
+    while (pos < good) {
+        char op;
+        int num, count;
+        
+        if (data[pos] == '.') {
+            pos += 2;
+            edits++;
+            continue;
+        }
+        int n = journal_record(data, pos, size, &op, &num, &count);
+        last_line = num > 0 ? num : 1;
+        
+        if (op == 'T' && num >= 1 && num <= doc->line_count) {
+            Line *line = get_line_at(ed, num);
+            line_reserve(line, count);
+            memcpy(line->text, &data[pos + n], count);
+            line->text[count] = '\0';
+            line->length = count;
+            line_changed(ed, line);
+            n += count + 1;
+        } else if (op == 'I' && num >= 0 && num <= doc->line_count && count > 0) {
+            Line *first = create_line();
+            Line *last = first;
+            for (int i = 1; i < count; i++) {
+                Line *line = create_line();
+                last->next = line;
+                line->prev = last;
+                last = line;
+            }
+            link_lines(ed, num ? get_line_at(ed, num) : NULL, first, last, count);
+        } else if (op == 'D' && num >= 1 && count > 0 && count < doc->line_count &&
+                   num + count - 1 <= doc->line_count) {
+            Line *first = get_line_at(ed, num);
+            Line *last = first;
+            for (int i = 1; i < count; i++) last = last->next;
+            unlink_lines(ed, first, last, count);
+            last->next = NULL;
+            while (first) {
+                Line *next = first->next;
+                free_line(first);
+                first = next;
+            }
+        } else {
+            good = pos;  // Doesn't fit the file; keep what was applied
+            break;
+        }
+        pos += n;
+    }
+    ed->journal_off = journal_off;
+    free(data);
+    
+    if (pos > header) {
+        char msg[80 + MAX_PATH];
+        doc->modified = 1;
+        doc->current_line = get_line_at(ed, last_line < doc->line_count ? last_line : doc->line_count);
+        doc->cursor_x = 0;
+        doc->journal = open_journal(doc, good);
+        snprintf(msg, sizeof(msg), "Recovered %d unsaved edits from %s", edits, path);
+        update_status(ed, msg);
+    }
+}
+
+// Drop what an inactive buffer can rebuild when shown again: layout
+// caches and the spare capacity of each line
+void compact_document(Document *doc) {
+    for (Line *line = doc->first_line; line; line = line->next) {
+        free(line->wrap_breaks);
+        line->wrap_breaks = NULL;
+        line->wrap_width = 0;
+        free(line->col_marks);
+        line->col_marks = NULL;
+        line->col_tab = 0;
+        if (line->capacity > line->length + 1 && !line->save && !line->cold) {
+            line->capacity = line->length + 1;
+            line->text = (char *)realloc(line->text, line->capacity);
+        }
+    }
+}
+
+// Room needed to compress n bytes with lz_pack()
+int lz_bound(int n) {
+    return n + n / 255 + 16;
+}
+
+// Append an LZ length that didn't fit its nibble: 255s, then the rest
+static unsigned char *lz_length(unsigned char *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Append one LZ sequence: a token holding the literal count and match
+// length in a nibble each, the literals, then the match's offset back.
+// The last sequence of a block has literals only.
+static unsigned char *lz_sequence(unsigned char *op, const unsigned char *lit, int lit_len,
+                                  int offset, int match_len) {
+    int extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    unsigned char *token = op++;
+    
+    *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (extra < 15 ? extra : 15));
+    if (lit_len >= 15) op = lz_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    
+    if (match_len) {
+        *op++ = (unsigned char)(offset & 0xFF);
+        *op++ = (unsigned char)(offset >> 8);
+        if (extra >= 15) op = lz_length(op, extra - 15);
+    }
+    return op;
+}
+
+// Compress n bytes into dst, which holds lz_bound(n), and return the
+// compressed length. A greedy LZ77 in the style of LZ4: matches of four
+// bytes or more within the last 64 KB are found through a hash of the
+// next four bytes.
+int lz_pack(const char *src, int n, char *dst) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    int table[1 << LZ_HASH_BITS];
+    int i = 0, lit = 0;
+    
+    memset(table, 0xFF, sizeof(table));
+    while (i + LZ_MIN_MATCH <= n) {
+        unsigned v;
+        memcpy(&v, &in[i], 4);
+        unsigned h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = i;
+        
+        if (ref < 0 || i - ref > 0xFFFF || memcmp(&in[ref], &in[i], LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (i + len < n && in[ref + len] == in[i + len]) len++;
+        
+        op = lz_sequence(op, &in[lit], i - lit, i - ref, len);
+        i += len;
+        lit = i;
+    }
+    op = lz_sequence(op, &in[lit], n - lit, 0, 0);
+    return (int)(op - (unsigned char *)dst);
+}
+
+// Decompress what lz_pack() wrote; returns the unpacked length
+int lz_unpack(const char *src, int n, char *dst, int raw_len) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + n;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + raw_len;
+    
+    while (ip < end) {
+        int token = *ip++;
+        int len = token >> 4;
+        if (len == 15) {
+            int b;
+            do { b = *ip++; len += b; } while (b == 255);
+        }
+        if (len > op_end - op) break;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip >= end) break;
+        
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        len = token & 15;
+        if (len == 15) {
+            int b;
+            do { b = *ip++; len += b; } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - (unsigned char *)dst || len > op_end - op) break;
+        
+        // Byte by byte: the match may overlap what it produces
+        const unsigned char *match = op - offset;
+        while (len--) *op++ = *match++;
+    }
+    return (int)(op - (unsigned char *)dst);
+}
+
+// Make sure a line's text is in memory before it is read or changed
+void line_warm(Line *line) {
+    if (line->cold) thaw_chunk(line->cold);
+}
+
+// Warm every line from first to last
+void warm_lines(Line *first, Line *last) {
+    for (Line *line = first; line; line = line->next) {
+        line_warm(line);
+        if (line == last) break;
+    }
+}
+
+// A chunk's text, unpacked into its document's peek buffer
+static const char *chunk_text(ColdChunk *chunk) {
+    Document *doc = chunk->doc;
+    
+    if (doc->peek_chunk != chunk) {
+        if (doc->peek_cap < chunk->raw_len) {
+            doc->peek_cap = chunk->raw_len;
+            doc->peek_buf = (char *)realloc(doc->peek_buf, doc->peek_cap);
+        }
+        lz_unpack(chunk->packed, chunk->packed_len, doc->peek_buf, chunk->raw_len);
+        doc->peek_chunk = chunk;
+    }
+    return doc->peek_buf;
+}
+
+// A line's text for reading only. A cold line is read from its unpacked
+// chunk, so a search passing through compressed text doesn't bring it
+// all back into memory.
+const char *line_peek(Line *line) {
+    if (!line->cold) return line->text;
+    return &chunk_text(line->cold)[line->cold->offsets[line->capacity]];
+}
+
+// Compress the text of count lines from first, raw_len bytes counting a
+// terminator for each, into one chunk, and free the lines' own copies
+void freeze_lines(Document *doc, Line *first, int count, int raw_len) {
+    ColdChunk *chunk = (ColdChunk *)calloc(1, sizeof(ColdChunk));
+    char *raw = (char *)malloc(raw_len);
+    int pos = 0;
+    
+    chunk->doc = doc;
+    chunk->lines = (Line **)malloc(count * sizeof(Line *));
+    chunk->offsets = (int *)malloc(count * sizeof(int));
+    chunk->count = chunk->live = count;
+    chunk->raw_len = raw_len;
+    
+    Line *line = first;
+    for (int i = 0; i < count; i++, line = line->next) {
+        memcpy(&raw[pos], line->text, line->length + 1);
+        chunk->lines[i] = line;
+        chunk->offsets[i] = pos;
+        pos += line->length + 1;
+    }
+    
+    chunk->packed = (char *)malloc(lz_bound(raw_len));
+    chunk->packed_len = lz_pack(raw, raw_len, chunk->packed);
+    chunk->packed = (char *)realloc(chunk->packed, chunk->packed_len);
+    free(raw);
+    
+    line = first;
+    for (int i = 0; i < count; i++, line = line->next) {
+        free(line->text);
+        line->text = NULL;
+        line->capacity = i;
+        line->cold = chunk;
+        free(line->wrap_breaks);
+        line->wrap_breaks = NULL;
+        line->wrap_width = 0;
+        free(line->col_marks);
+        line->col_marks = NULL;
+        line->col_tab = 0;
+    }
+    
+    doc->cold_chunks++;
+    doc->cold_raw += raw_len;
+    doc->cold_packed += chunk->packed_len;
+}
+
+// Unpack a chunk back into its lines
+void thaw_chunk(ColdChunk *chunk) {
+    const char *raw = chunk_text(chunk);
+    unsigned now = GetTickCount() / 1000;
+    
+    for (int i = 0; i < chunk->count; i++) {
+        Line *line = chunk->lines[i];
+        if (!line) continue;
+        
+        line->text = (char *)malloc(line->length + 1);
+        memcpy(line->text, &raw[chunk->offsets[i]], line->length + 1);
+        line->capacity = line->length + 1;
+        line->cold = NULL;
+        line->used = now;
+        chunk->lines[i] = NULL;
+    }
+    chunk->live = 0;
+    drop_chunk(chunk);
+}
+
+// Free a chunk once no line is cold in it and no save reads from it
+void drop_chunk(ColdChunk *chunk) {
+    if (chunk->live > 0 || chunk->refs > 0) return;
+    
+    Document *doc = chunk->doc;
+    doc->cold_chunks--;
+    doc->cold_raw -= chunk->raw_len;
+    doc->cold_packed -= chunk->packed_len;
+    if (doc->peek_chunk == chunk) doc->peek_chunk = NULL;
+    
+    free(chunk->packed);
+    free(chunk->lines);
+    free(chunk->offsets);
+    free(chunk);
+}
+
+// A run of lines that may be compressed together
+typedef struct {
+    Document *doc;
+    Line *first;
+    int count;
+    int raw_len;
+    long long saves;  // Memory compressing it would give back, roughly
+    unsigned used;    // Most recent use of any of its lines
+} ColdRun;
+
+static int cold_run_older(const void *a, const void *b) {
+    unsigned ua = ((const ColdRun *)a)->used, ub = ((const ColdRun *)b)->used;
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Compress text nobody has used for COLD_AGE seconds and then, while the
+// text in memory is over the budget, the least recently used runs down to
+// COLD_MIN_AGE. Runs are cut at COLD_CHUNK_LINES lines or COLD_CHUNK_BYTES.
+// Each call looks at up to COLD_SLICE_LINES lines, carrying on from where
+// the last one stopped, so the UI thread is never held for a whole pass;
+// the budget is judged by what the last whole pass counted, and the oldest
+// runs go first within a slice. Returns 1 while the pass is unfinished.
+int cool_documents(Editor *ed) {
+    unsigned now = GetTickCount() / 1000;
+    ColdRun *runs = NULL;
+    int run_count = 0, run_cap = 0;
+    int looked = 0;
+    
+    while (looked < COLD_SLICE_LINES) {
+        if (ed->cool_doc >= ed->doc_count) {
+            // Pass done: its count is the new measure
+            ed->cool_resident = ed->cool_counted;
+            ed->cool_counted = 0;
+            ed->cool_doc = 0;
+            break;
+        }
+        Document *doc = ed->docs[ed->cool_doc];
+        ColdRun run = {doc, NULL, 0, 0, 0, 0};
+        Line *line = doc->cool_at.line;
+        
+        if (!line) {
+            line = doc->first_line;
+            ed->cool_counted += doc->cold_packed;
+        }
+        for (; ; line = line->next) {
+            int stop = !line || looked == COLD_SLICE_LINES;
+            int eligible = !stop && !line->cold && !doc->save && now - line->used >= COLD_MIN_AGE &&
+                           line != doc->current_line;
+            
+            if (run.count && (!eligible || run.count == COLD_CHUNK_LINES ||
+                              run.raw_len + line->length + 1 > COLD_CHUNK_BYTES)) {
+                if (run_count == run_cap) {
+                    run_cap = run_cap ? run_cap * 2 : 256;
+                    runs = (ColdRun *)realloc(runs, run_cap * sizeof(ColdRun));
+                }
+                runs[run_count++] = run;
+                run.count = 0;
+            }
+            if (stop) break;
+            looked++;
+            if (!line->cold) ed->cool_counted += line->capacity;
+            if (!eligible) continue;
+            
+            if (!run.count) {
+                run.first = line;
+                run.raw_len = 0;
+                run.saves = 0;
+                run.used = 0;
+            }
+            run.count++;
+            run.raw_len += line->length + 1;
+            run.saves += line->capacity;
+            if (line->used > run.used || run.count == 1) run.used = line->used;
+        }
+        doc->cool_at.line = line;
+        doc->cool_at.col = 0;
+        if (!line) ed->cool_doc++;
+    }
+    
+    // Oldest first, so a budget squeeze takes the longest unused text
+    long long resident = ed->cool_resident > ed->cool_counted ? ed->cool_resident : ed->cool_counted;
+    if (run_count) qsort(runs, run_count, sizeof(ColdRun), cold_run_older);
+    for (int i = 0; i < run_count; i++) {
+        ColdRun *run = &runs[i];
+        if (now - run->used < COLD_AGE && resident <= ed->cold_budget) break;
+        if (run->raw_len < 64) continue;  // Not worth a chunk
+        
+        Document *doc = run->doc;
+        long long before = doc->cold_packed;
+        freeze_lines(doc, run->first, run->count, run->raw_len);
+        long long freed = run->saves - (doc->cold_packed - before);
+        resident -= freed;
+        ed->cool_resident -= freed;
+        ed->cool_counted -= freed;
+    }
+    free(runs);
+    return ed->cool_doc != 0 || ed->docs[0]->cool_at.line != NULL;
+}
+
+// Show how much memory the current document's text takes, and how well
+// its cold text compresses
+void show_memory(Editor *ed) {
+    Document *doc = ed->doc;
+    long long warm = 0;
+    int cold_lines = 0;
+    char msg[160];
+    
+    for (Line *line = doc->first_line; line; line = line->next) {
+        if (line->cold) {
+            cold_lines++;
+        } else {
+            warm += line->capacity;
+        }
+    }
+    
+    if (doc->cold_chunks == 0) {
+        snprintf(msg, sizeof(msg), "Text: %lld KB in %d lines%s", warm / 1024, doc->line_count,
+                 ed->cold_budget ? ", none compressed yet" : ", compression off");
+    } else {
+        snprintf(msg, sizeof(msg), "Text: %lld KB; %d of %d lines compressed, %lld KB in %lld KB (%.1f:1) in %d chunks",
+                 warm / 1024, cold_lines, doc->line_count, doc->cold_raw / 1024, doc->cold_packed / 1024,
+                 doc->cold_packed ? (double)doc->cold_raw / doc->cold_packed : 0.0, doc->cold_chunks);
+    }
+    update_status(ed, msg);
+}
+
+// Show a document, restoring where it was on screen
+void show_document(Editor *ed, Document *doc) {
+    ed->doc = doc;
+    ed->top_line = doc->top_line;
+    ed->top_sub = doc->top_sub;
+    ed->screen_col = doc->screen_col;
+}
+
+// Switch to the buffer at index. Only the view is saved and restored;
+// the cursor, block and markers already live in each document.
+void switch_buffer(Editor *ed, int index) {
+    Document *old = ed->doc;
+    
+    if (ed->docs[index] == old) return;
+    
+    old->top_line = ed->top_line;
+    old->top_sub = ed->top_sub;
+    old->screen_col = ed->screen_col;
+    if (ed->doc_count > COMPACT_BUFFERS) compact_document(old);
+    
+    show_document(ed, ed->docs[index]);
+}
+
+// Position of the current buffer in the buffer list
+int buffer_index(Editor *ed) {
+    for (int i = 0; i < ed->doc_count; i++) {
+        if (ed->docs[i] == ed->doc) return i;
+    }
+    return 0;
+}
+
+// Edit a file in a buffer of its own, or switch to it if already open
+void open_buffer(Editor *ed, const char *filename) {
+    for (int i = 0; i < ed->doc_count; i++) {
+        if (_stricmp(ed->docs[i]->filename, filename) == 0) {
+            switch_buffer(ed, i);
+            update_status(ed, "Already open");
+            return;
+        }
+    }
+    
+    if (ed->doc_count == MAX_BUFFERS) {
+        update_status(ed, "Error: Too many open files");
+        return;
+    }
+    
+    ed->docs[ed->doc_count++] = create_document();
+    switch_buffer(ed, ed->doc_count - 1);
+    load_file(ed, filename);
+}
+
+// Close the current buffer and show the next one; closing the last buffer
+// leaves the editor. With abandon set unsaved edits are given up.
+void close_buffer(Editor *ed, int abandon) {
+    int index = buffer_index(ed);
+    Document *doc = ed->doc;
+    
+    // The journal goes once the text is saved or abandoned; unsaved
+    // edits keep it for recovery
+    finish_save(ed, doc);
+    close_journal(doc, abandon || !doc->modified);
+    
+    if (ed->doc_count == 1) {
+        if (!ed->batch) exit(0);
+        ed->quit = abandon ? QUIT_ABANDON : QUIT_EXIT;
+        return;
+    }
+    
+    memmove(&ed->docs[index], &ed->docs[index + 1], (ed->doc_count - index - 1) * sizeof(Document *));
+    ed->doc_count--;
+    show_document(ed, ed->docs[index < ed->doc_count ? index : 0]);
+    retarget_panes(ed, doc, ed->doc);
+    free_document(doc);
+    update_status(ed, "File closed");
+}
+
+// Prompt for a buffer, listing the open ones
+void pick_buffer(Editor *ed) {
+    char list[256];
+    int len = 0;
+    
+    for (int i = 0; i < ed->doc_count && len < (int)sizeof(list) - 16; i++) {
+        len += snprintf(&list[len], sizeof(list) - len, " %d %s%s", i + 1,
+                        ed->docs[i]->filename, ed->docs[i]->modified ? "*" : "");
+    }
+    snprintf(&list[len], sizeof(list) - len, "  Buffer: ");
+    
+    ed->state = STATE_PICK_BUFFER;
+    ed->input_buffer[0] = '\0';
+    ed->input_pos = 0;
+    update_status(ed, list);
+}
+
+// Share the text area between the panes, with a divider under each pane
+// but the last
+void layout_panes(Editor *ed) {
+    int total = EDIT_END - EDIT_START + 1 - (ed->pane_count - 1);
+    int row = EDIT_START;
+    
+    for (int i = 0; i < ed->pane_count; i++) {
+        Pane *pane = &ed->panes[i];
+        pane->first_row = row;
+        pane->rows = total / ed->pane_count + (i < total % ed->pane_count ? 1 : 0);
+        row += pane->rows + 1;
+    }
+    ed->view_top = ed->panes[ed->pane].first_row;
+    ed->view_rows = ed->panes[ed->pane].rows;
+}
+
+// Park the active pane: its cursor and top line become anchors in its
+// document, kept valid while another pane edits the text
+void deactivate_pane(Editor *ed) {
+    Pane *pane = &ed->panes[ed->pane];
+    
+    pane->doc = ed->doc;
+    pane->cursor.line = ed->doc->current_line;
+    pane->cursor.col = ed->doc->cursor_x;
+    pane->top.line = get_line_at(ed, ed->top_line + 1);
+    pane->top.col = 0;
+    pane->top_sub = ed->top_sub;
+    pane->screen_col = ed->screen_col;
+    register_anchor(ed->doc, &pane->cursor);
+    register_anchor(ed->doc, &pane->top);
+}
+
+// Make a pane the active one, taking its cursor and view back
+void activate_pane(Editor *ed, int index) {
+    Pane *pane = &ed->panes[index];
+    Document *doc = pane->doc;
+    
+    unregister_anchor(doc, &pane->cursor);
+    unregister_anchor(doc, &pane->top);
+    
+    ed->pane = index;
+    ed->doc = doc;
+    if (pane->cursor.line) {
+        doc->current_line = pane->cursor.line;
+        doc->cursor_x = pane->cursor.col < pane->cursor.line->length ? pane->cursor.col :
+                                                                        pane->cursor.line->length;
+    } else {
+        // The text was replaced since this pane was last active
+        doc->current_line = doc->first_line;
+        doc->cursor_x = 0;
+    }
+    ed->top_line = pane->top.line ? get_line_number(ed, pane->top.line) - 1 : 0;
+    ed->top_sub = pane->top_sub;
+    ed->screen_col = pane->screen_col;
+    layout_panes(ed);
+}
+
+// Split the active pane, opening a second view of the same document
+// below it
+void split_window(Editor *ed) {
+    if (ed->pane_count == MAX_PANES ||
+        (EDIT_END - EDIT_START + 1 - ed->pane_count) / (ed->pane_count + 1) < MIN_PANE_ROWS) {
+        update_status(ed, "No room for another window");
+        return;
+    }
+    
+    memmove(&ed->panes[ed->pane + 2], &ed->panes[ed->pane + 1],
+            (ed->pane_count - ed->pane - 1) * sizeof(Pane));
+    ed->pane_count++;
+    
+    // Panes moved in the array; their anchors must follow
+    for (int i = ed->pane_count - 1; i >= ed->pane + 2; i--) {
+        Pane *pane = &ed->panes[i];
+        replace_anchor(pane->doc, &ed->panes[i - 1].cursor, &pane->cursor);
+        replace_anchor(pane->doc, &ed->panes[i - 1].top, &pane->top);
+    }
+    
+    deactivate_pane(ed);
+    ed->panes[ed->pane + 1] = ed->panes[ed->pane];
+    unregister_anchor(ed->doc, &ed->panes[ed->pane].cursor);
+    unregister_anchor(ed->doc, &ed->panes[ed->pane].top);
+    register_anchor(ed->doc, &ed->panes[ed->pane + 1].cursor);
+    register_anchor(ed->doc, &ed->panes[ed->pane + 1].top);
+    layout_panes(ed);
+    update_status(ed, "Window opened");
+}
+
+// Move to the next pane down, wrapping to the top
+void next_window(Editor *ed) {
+    if (ed->pane_count == 1) return;
+    deactivate_pane(ed);
+    activate_pane(ed, (ed->pane + 1) % ed->pane_count);
+}
+
+// Close the active pane; the one after it (or before, for the last) takes
+// over its rows
+void close_window(Editor *ed) {
+    int index = ed->pane;
+    
+    if (ed->pane_count == 1) {
+        update_status(ed, "Only one window");
+        return;
+    }
+    
+    for (int i = index + 1; i < ed->pane_count; i++) {
+        Pane *pane = &ed->panes[i];
+        replace_anchor(pane->doc, &pane->cursor, &ed->panes[i - 1].cursor);
+        replace_anchor(pane->doc, &pane->top, &ed->panes[i - 1].top);
+        ed->panes[i - 1] = *pane;
+    }
+    ed->pane_count--;
+    ed->pane = index < ed->pane_count ? index : ed->pane_count - 1;
+    activate_pane(ed, ed->pane);
+    update_status(ed, "Window closed");
+}
+
+// Point inactive panes showing a document that is being closed at another
+void retarget_panes(Editor *ed, Document *from, Document *to) {
+    for (int i = 0; i < ed->pane_count; i++) {
+        Pane *pane = &ed->panes[i];
+        if (i == ed->pane || pane->doc != from) continue;
+        
+        pane->doc = to;
+        pane->cursor.line = to->current_line;
+        pane->cursor.col = to->cursor_x;
+        pane->top.line = to->first_line;
+        pane->top.col = 0;
+        pane->top_sub = 0;
+        pane->screen_col = 0;
+        register_anchor(to, &pane->cursor);
+        register_anchor(to, &pane->top);
+    }
+}
+
+// Block operations
+void mark_block_begin(Editor *ed) {
+    ed->doc->block.start.line = ed->doc->current_line;
+    ed->doc->block.start.col = ed->doc->cursor_x;
+    if (!ed->doc->block.active || ed->doc->block.end.line == NULL) {
+        ed->doc->block.end.line = ed->doc->current_line;
+        ed->doc->block.end.col = ed->doc->cursor_x;
+    }
+    ed->doc->block.active = 1;
+    update_status(ed, "Block begin marked");
+}
+
+void mark_block_end(Editor *ed) {
+    ed->doc->block.end.line = ed->doc->current_line;
+    ed->doc->block.end.col = ed->doc->cursor_x;
+    if (!ed->doc->block.active || ed->doc->block.start.line == NULL) {
+        ed->doc->block.start.line = ed->doc->current_line;
+        ed->doc->block.start.col = ed->doc->cursor_x;
+    }
+    ed->doc->block.active = 1;
+    update_status(ed, "Block end marked");
+}
+
+void hide_block(Editor *ed) {
+    ed->doc->block.active = 0;
+    update_status(ed, "Block hidden");
+}
+
+// Clear clipboard
+void clear_clipboard(Editor *ed) {
+    Line *line = ed->clipboard;
+    while (line) {
+        Line *next = line->next;
+        free_line(line);
+        line = next;
     }
     ed->clipboard = NULL;
     ed->clipboard_lines = 0;
 }
 
-// Duplicate lines
-Line *duplicate_lines(Line *start, Line *end, int *count) {
-    Line *new_start = NULL;
-    Line *new_prev = NULL;
-    Line *curr = start;
+// Duplicate lines
+Line *duplicate_lines(Line *start, Line *end, int *count) {
+    Line *new_start = NULL;
+    Line *new_prev = NULL;
+    Line *curr = start;
+    *count = 0;
+    
+    while (curr) {
+        Line *new = create_line();
+        line_warm(curr);
+        if (new->capacity <= curr->length) {
+            new->capacity = curr->length + 1;
+            new->text = (char *)realloc(new->text, new->capacity);
+        }
+        strcpy(new->text, curr->text);
+        new->length = curr->length;
+        
+        if (new_prev) {
+            new_prev->next = new;
+            new->prev = new_prev;
+        } else {
+            new_start = new;
+        }
+        new_prev = new;
+        (*count)++;
+        
+        if (curr == end) break;
+        curr = curr->next;
+    }
+    
+    return new_start;
+}
+
+// Insert lines at current position
+void insert_lines(Editor *ed, Line *lines, int count) {
+    if (!lines || count == 0) return;
+    
+    Line *curr = ed->doc->current_line;
+    Line *last = lines;
+    
+    // Find last line in clipboard
+    while (last->next) {
+        last = last->next;
+    }
+    
+    // Insert after current line
+    link_lines(ed, curr, lines, last, count);
+    ed->doc->modified = 1;
+}
+
+// Check whether position 1 comes before position 2
+int pos_before(Line *l1, int c1, Line *l2, int c2) {
+    return l1->order < l2->order || (l1 == l2 && c1 < c2);
+}
+
+// Get the block bounds in document order, columns clamped to the text.
+// Column blocks return the rectangle's left and right columns.
+int get_block_bounds(Editor *ed, Line **l1, int *c1, Line **l2, int *c2) {
+    Block *b = &ed->doc->block;
+    
+    if (!b->active || !b->start.line || !b->end.line) {
+        update_status(ed, "No block marked");
+        return 0;
+    }
+    
+    *l1 = b->start.line;
+    *l2 = b->end.line;
+    
+    if (b->column_mode) {
+        *c1 = b->start.col < b->end.col ? b->start.col : b->end.col;
+        *c2 = b->start.col < b->end.col ? b->end.col : b->start.col;
+        if ((*l1)->order > (*l2)->order || *c1 == *c2) {
+            update_status(ed, "Block end is before block begin");
+            return 0;
+        }
+    } else {
+        *c1 = b->start.col < (*l1)->length ? b->start.col : (*l1)->length;
+        *c2 = b->end.col < (*l2)->length ? b->end.col : (*l2)->length;
+        if (!pos_before(*l1, *c1, *l2, *c2)) {
+            update_status(ed, "Block end is before block begin");
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Toggle column (rectangular) block mode
+void toggle_column_mode(Editor *ed) {
+    ed->doc->block.column_mode = !ed->doc->block.column_mode;
+    update_status(ed, ed->doc->block.column_mode ? "Column block mode ON" : "Column block mode OFF");
+}
+
+// Copy the text between two positions into a detached chain of lines
+Line *copy_range(Line *l1, int c1, Line *l2, int c2, int *count) {
+    Line *first = NULL;
+    Line *prev = NULL;
+    *count = 0;
+    
+    for (Line *line = l1; line; line = line->next) {
+        int from = (line == l1) ? c1 : 0;
+        int to = (line == l2) ? c2 : line->length;
+        line_warm(line);
+        Line *new = create_line_text(&line->text[from], to - from);
+        
+        if (prev) {
+            prev->next = new;
+            new->prev = prev;
+        } else {
+            first = new;
+        }
+        prev = new;
+        (*count)++;
+        
+        if (line == l2) break;
+    }
+    
+    return first;
+}
+
+// Copy columns [c1, c2) of each line from l1 to l2 into a chain of slices
+Line *copy_columns(Line *l1, Line *l2, int c1, int c2, int *count) {
+    Line *first = NULL;
+    Line *prev = NULL;
     *count = 0;
     
-    while (curr) {
-        Line *new = create_line();
-        if (new->capacity <= curr->length) {
-            new->capacity = curr->length + 1;
-            new->text = (char *)realloc(new->text, new->capacity);
-        }
-        strcpy(new->text, curr->text);
-        new->length = curr->length;
+    for (Line *line = l1; line; line = line->next) {
+        int from = char_start(line, c1 < line->length ? c1 : line->length);
+        int to = char_start(line, c2 < line->length ? c2 : line->length);
+        Line *new = create_line_text(&line->text[from], to - from);
         
-        if (new_prev) {
-            new_prev->next = new;
-            new->prev = new_prev;
+        if (prev) {
+            prev->next = new;
+            new->prev = prev;
         } else {
-            new_start = new;
+            first = new;
         }
-        new_prev = new;
+        prev = new;
         (*count)++;
         
-        if (curr == end) break;
-        curr = curr->next;
+        if (line == l2) break;
     }
     
-    return new_start;
+    return first;
 }
 
-// Copy block
-void copy_block(Editor *ed) {
-    if (!ed->block.active) {
-        update_status(ed, "No block marked");
-        return;
+// Delete the text between two positions, joining the surviving ends
+void delete_range(Editor *ed, Line *l1, int c1, Line *l2, int c2) {
+    if (l1 == l2) {
+        line_own(l1);
+        memmove(&l1->text[c1], &l1->text[c2], l1->length - c2 + 1);
+        l1->length -= c2 - c1;
+        line_changed(ed, l1);
+        adjust_anchors(ed, l1, c1, c2 - c1, 0);
+    } else {
+        int tail = l2->length - c2;
+        line_warm(l2);
+        line_reserve(l1, c1 + tail);
+        memcpy(&l1->text[c1], &l2->text[c2], tail + 1);
+        adjust_anchors(ed, l1, c1, l1->length - c1, 0);
+        move_anchors(ed, l2, c2, l1, c1);
+        l1->length = c1 + tail;
+        line_changed(ed, l1);
+        
+        int removed = 0;
+        for (Line *line = l1->next; line != l2->next; line = line->next) removed++;
+        
+        Line *line = l1->next;
+        drop_anchors(ed, line, l2, l1, c1);
+        unlink_lines(ed, line, l2, removed);
+        while (line) {
+            Line *next = line->next;
+            free_line(line);
+            line = next;
+        }
     }
     
-    clear_clipboard(ed);
-    ed->clipboard = duplicate_lines(ed->block.start_line, ed->block.end_line, 
-                                   &ed->clipboard_lines);
-    update_status(ed, "Block copied to clipboard");
+    ed->doc->modified = 1;
 }
 
-// Insert lines at current position
-void insert_lines(Editor *ed, Line *lines, int count) {
-    if (!lines || count == 0) return;
-    
-    Line *curr = ed->doc.current_line;
-    Line *last = lines;
+// Delete columns [c1, c2) from each line in place
+void delete_columns(Editor *ed, Line *l1, Line *l2, int c1, int c2) {
+    for (Line *line = l1; line; line = line->next) {
+        int from = char_start(line, c1 < line->length ? c1 : line->length);
+        int to = char_start(line, c2 < line->length ? c2 : line->length);
+        
+        if (to > from) {
+            line_own(line);
+            memmove(&line->text[from], &line->text[to], line->length - to + 1);
+            line->length -= to - from;
+            line_changed(ed, line);
+            adjust_anchors(ed, line, from, to - from, 0);
+        }
+        
+        if (line == l2) break;
+    }
     
-    // Find last line in clipboard
+    ed->doc->modified = 1;
+}
+
+// Splice a detached chain of lines into the text at a position.
+// The first chain line joins the text before col and the last one takes
+// over the text after it; the chain's nodes are reused or freed.
+void insert_range(Editor *ed, Line *at, int col, Line *chain, int count) {
+    Line *last = chain;
     while (last->next) {
         last = last->next;
     }
+    line_warm(chain);
+    line_warm(at);
     
-    // Insert after current line
-    last->next = curr->next;
-    if (curr->next) {
-        curr->next->prev = last;
-    }
+    int tail = at->length - col;
     
-    lines->prev = curr;
-    curr->next = lines;
+    if (count == 1) {
+        line_reserve(at, at->length + chain->length);
+        memmove(&at->text[col + chain->length], &at->text[col], tail + 1);
+        memcpy(&at->text[col], chain->text, chain->length);
+        at->length += chain->length;
+        line_changed(ed, at);
+        adjust_anchors(ed, at, col, 0, chain->length);
+        free_line(chain);
+    } else {
+        // The chain is new text, so last needs no line_changed() until linked
+        line_reserve(last, last->length + tail);
+        memcpy(&last->text[last->length], &at->text[col], tail + 1);
+        // Anchors after col follow the tail; one exactly at col stays put
+        move_anchors(ed, at, col + 1, last, last->length + 1);
+        last->length += tail;
+        
+        line_reserve(at, col + chain->length);
+        memcpy(&at->text[col], chain->text, chain->length + 1);
+        at->length = col + chain->length;
+        line_changed(ed, at);
+        
+        Line *rest = chain->next;
+        rest->prev = NULL;
+        chain->next = NULL;
+        free_line(chain);
+        link_lines(ed, at, rest, last, count - 1);
+    }
     
-    ed->doc.line_count += count;
-    ed->doc.modified = 1;
+    ed->doc->modified = 1;
 }
 
-// Move block
-void move_block(Editor *ed) {
-    if (!ed->block.active) {
-        update_status(ed, "No block marked");
+// Replace the text between two positions with text that may contain '\n'
+// line breaks, returning the position just after the new text. Within a
+// line this is one memmove; otherwise the new lines are built first and
+// spliced in with insert_range().
+void replace_range(Editor *ed, Line *l1, int c1, Line *l2, int c2,
+                   const char *text, int len, Line **end_line, int *end_col) {
+    if (l1 == l2 && !memchr(text, '\n', len)) {
+        int removed = c2 - c1;
+        line_reserve(l1, l1->length - removed + len);
+        memmove(&l1->text[c1 + len], &l1->text[c2], l1->length - c2 + 1);
+        memcpy(&l1->text[c1], text, len);
+        l1->length += len - removed;
+        line_changed(ed, l1);
+        adjust_anchors(ed, l1, c1, removed, len);
+        ed->doc->modified = 1;
+        
+        if (end_line) *end_line = l1;
+        if (end_col) *end_col = c1 + len;
         return;
     }
     
-    // Copy to clipboard
-    copy_block(ed);
+    if (l1 != l2 || c1 != c2) delete_range(ed, l1, c1, l2, c2);
+    
+    Line *chain = NULL, *last = NULL;
+    int count = 0, i = 0;
+    for (;;) {
+        int start = i;
+        while (i < len && text[i] != '\n') i++;
+        
+        Line *line = create_line_text(&text[start], i - start);
+        if (last) {
+            last->next = line;
+            line->prev = last;
+        } else {
+            chain = line;
+        }
+        last = line;
+        count++;
+        
+        if (i == len) break;
+        i++;
+    }
     
-    // Delete original
-    delete_block(ed);
+    int end = count == 1 ? c1 + last->length : last->length;
+    insert_range(ed, l1, c1, chain, count);
     
-    // Insert at current position
-    if (ed->clipboard) {
-        Line *dup_clip = duplicate_lines(ed->clipboard, NULL, &ed->clipboard_lines);
-        insert_lines(ed, dup_clip, ed->clipboard_lines);
-        update_status(ed, "Block moved");
+    while (--count > 0) {
+        l1 = l1->next;
     }
+    if (end_line) *end_line = l1;
+    if (end_col) *end_col = end;
 }
 
-// Delete block
-void delete_block(Editor *ed) {
-    if (!ed->block.active) {
-        update_status(ed, "No block marked");
-        return;
+// Insert text that may contain '\n' line breaks at a position
+void insert_string(Editor *ed, Line *line, int col, const char *text, int len,
+                   Line **end_line, int *end_col) {
+    replace_range(ed, line, col, line, col, text, len, end_line, end_col);
+}
+
+// Insert each chain slice into successive lines at col, padding short
+// lines with spaces and adding lines at the end of the document as needed
+void insert_columns(Editor *ed, Line *at, int col, Line *chain) {
+    Line *line = at;
+    Line *prev = at->prev;
+    
+    while (chain) {
+        Line *slice = chain;
+        chain = chain->next;
+        
+        if (!line) {
+            line = create_line();
+            link_lines(ed, prev, line, line, 1);
+        }
+        
+        int at = char_start(line, col < line->length ? col : line->length);
+        line_reserve(line, (col > line->length ? col : line->length) + slice->length);
+        while (line->length < col) {
+            line->text[line->length++] = ' ';
+            at = line->length;
+        }
+        memmove(&line->text[at + slice->length], &line->text[at], line->length - at + 1);
+        memcpy(&line->text[at], slice->text, slice->length);
+        line->length += slice->length;
+        line->text[line->length] = '\0';
+        line_changed(ed, line);
+        adjust_anchors(ed, line, at, 0, slice->length);
+        
+        free_line(slice);
+        prev = line;
+        line = line->next;
     }
     
-    Line *start = ed->block.start_line;
-    Line *end = ed->block.end_line;
+    ed->doc->modified = 1;
+}
+
+// Insert a copy of the clipboard at the cursor
+void paste_clipboard(Editor *ed) {
+    int count;
+    
+    if (!ed->clipboard) return;
+    
+    Line *dup_clip = duplicate_lines(ed->clipboard, NULL, &count);
     
-    // Connect previous to next
-    if (start->prev) {
-        start->prev->next = end->next;
+    if (ed->clipboard_column) {
+        insert_columns(ed, ed->doc->current_line, ed->doc->cursor_x, dup_clip);
     } else {
-        ed->doc.first_line = end->next;
+        insert_range(ed, ed->doc->current_line, ed->doc->cursor_x, dup_clip, count);
     }
+}
+
+// Copy block to the cursor (the clipboard keeps the copied text)
+void copy_block(Editor *ed) {
+    Line *l1, *l2;
+    int c1, c2;
+    
+    if (!get_block_bounds(ed, &l1, &c1, &l2, &c2)) return;
     
-    if (end->next) {
-        end->next->prev = start->prev;
+    clear_clipboard(ed);
+    ed->clipboard_column = ed->doc->block.column_mode;
+    if (ed->clipboard_column) {
+        ed->clipboard = copy_columns(l1, l2, c1, c2, &ed->clipboard_lines);
+    } else {
+        ed->clipboard = copy_range(l1, c1, l2, c2, &ed->clipboard_lines);
     }
     
-    // Count deleted lines
-    int deleted = 0;
-    Line *curr = start;
-    while (curr) {
-        Line *next = curr->next;
-        free_line(curr);
-        deleted++;
-        if (curr == end) break;
-        curr = next;
+    paste_clipboard(ed);
+    update_status(ed, "Block copied");
+}
+
+// Move block to the cursor
+void move_block(Editor *ed) {
+    Line *l1, *l2;
+    int c1, c2;
+    
+    if (!get_block_bounds(ed, &l1, &c1, &l2, &c2)) return;
+    
+    Line *cur = ed->doc->current_line;
+    int x = ed->doc->cursor_x;
+    
+    clear_clipboard(ed);
+    ed->clipboard_column = ed->doc->block.column_mode;
+    
+    if (ed->doc->block.column_mode) {
+        int in_rows = is_line_in_block(ed, cur);
+        if (in_rows && x > c1 && x < c2) {
+            update_status(ed, "Cursor is inside the block");
+            return;
+        }
+        
+        ed->clipboard = copy_columns(l1, l2, c1, c2, &ed->clipboard_lines);
+        delete_columns(ed, l1, l2, c1, c2);
+        if (in_rows && x >= c2) x -= c2 - c1;
+    } else {
+        if (pos_before(l1, c1, cur, x) && pos_before(cur, x, l2, c2)) {
+            update_status(ed, "Cursor is inside the block");
+            return;
+        }
+        
+        ed->clipboard = copy_range(l1, c1, l2, c2, &ed->clipboard_lines);
+        if (cur == l2 && x >= c2) {
+            cur = l1;
+            x = c1 + (x - c2);
+        }
+        delete_range(ed, l1, c1, l2, c2);
     }
     
-    ed->doc.line_count -= deleted;
-    ed->doc.current_line = end->next ? end->next : 
-                           (start->prev ? start->prev : ed->doc.first_line);
-    ed->doc.cursor_x = 0;
+    ed->doc->current_line = cur;
+    ed->doc->cursor_x = x;
+    paste_clipboard(ed);
+    
+    ed->doc->block.active = 0;
+    update_status(ed, "Block moved");
+}
+
+// Delete block
+void delete_block(Editor *ed) {
+    Line *l1, *l2;
+    int c1, c2;
+    
+    if (!get_block_bounds(ed, &l1, &c1, &l2, &c2)) return;
+    
+    if (ed->doc->block.column_mode) {
+        delete_columns(ed, l1, l2, c1, c2);
+        ed->doc->current_line = l1;
+        ed->doc->cursor_x = c1 < l1->length ? c1 : l1->length;
+    } else {
+        delete_range(ed, l1, c1, l2, c2);
+        ed->doc->current_line = l1;
+        ed->doc->cursor_x = c1;
+    }
     
-    ed->block.active = 0;
-    ed->doc.modified = 1;
+    ed->doc->block.active = 0;
     update_status(ed, "Block deleted");
 }
 
 // Write block to file
 void write_block(Editor *ed, const char *filename) {
-    if (!ed->block.active) {
-        update_status(ed, "No block marked");
-        return;
-    }
+    Line *l1, *l2;
+    int c1, c2;
+    int count;
+    
+    if (!get_block_bounds(ed, &l1, &c1, &l2, &c2)) return;
     
-    FILE *fp = fopen(filename, "w");
+    FILE *fp = fopen(filename, "wb");
     if (!fp) {
         update_status(ed, "Error: Cannot write block");
         return;
     }
     
-    Line *curr = ed->block.start_line;
-    while (curr) {
-        fprintf(fp, "%s\r\n", curr->text);
-        if (curr == ed->block.end_line) break;
-        curr = curr->next;
+    // Written in the document's own format
+    FileFormat *ff = &ed->doc->file;
+    Line *text = ed->doc->block.column_mode ? copy_columns(l1, l2, c1, c2, &count) :
+                                         copy_range(l1, c1, l2, c2, &count);
+    write_bom(fp, ff);
+    while (text) {
+        Line *next = text->next;
+        write_encoded(fp, ff, text->text, text->length);
+        write_encoded(fp, ff, ff->newline, strlen(ff->newline));
+        free_line(text);
+        text = next;
     }
     
     fclose(fp);
     update_status(ed, "Block written to file");
 }
 
-// Read block from file
+// Read block from file, in whatever encoding it is stored
 void read_block(Editor *ed, const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
+    FileFormat ff = {ENC_UTF8, 0, "\r\n", 0};
+    long size;
+    int count;
+    
+    char *data = read_file_data(filename, &size);
+    if (!data) {
         update_status(ed, "Error: Cannot read file");
         return;
     }
     
-    Line *first = NULL;
-    Line *prev = NULL;
-    int count = 0;
-    char buffer[1024];
-    
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        Line *new = create_line();
-        
-        // Remove newline
-        int len = strlen(buffer);
-        if (len > 0 && buffer[len-1] == '\n') buffer[--len] = '\0';
-        if (len > 0 && buffer[len-1] == '\r') buffer[--len] = '\0';
-        
-        if (new->capacity <= len) {
-            new->capacity = len + 256;
-            new->text = (char *)realloc(new->text, new->capacity);
-        }
-        strcpy(new->text, buffer);
-        new->length = len;
-        
-        if (prev) {
-            prev->next = new;
-            new->prev = prev;
-        } else {
-            first = new;
-        }
-        prev = new;
-        count++;
-    }
-    
-    fclose(fp);
+    Line *first = decode_file(data, size, &ff, &count);
+    free(data);
     
-    if (first) {
+    if (count < 0) {
+        update_status(ed, "Error: File too big to read");
+    } else if (first) {
         insert_lines(ed, first, count);
         update_status(ed, "Block read from file");
     }
@@ -1206,16 +5720,23 @@ void find_text(Editor *ed) {
         return;
     }
     
-    Line *start_line = ed->doc.current_line;
-    int start_pos = ed->doc.cursor_x + 1;
+    Line *start_line = ed->doc->current_line;
+    int start_pos = ed->doc->cursor_x + 1;
     Line *line = start_line;
+    FileView *v = ed->doc->view;
+    long long hit;
+    int col;
+    
+    // After a replace at the end of the line there's nothing left to search
+    if (start_pos > line->length) start_pos = line->length;
     
     // Search forward
     while (line) {
-        char *found = strstr(&line->text[start_pos], ed->find.find_text);
+        const char *text = line_peek(line);
+        const char *found = strstr(&text[start_pos], ed->find.find_text);
         if (found) {
-            ed->doc.current_line = line;
-            ed->doc.cursor_x = found - line->text;
+            ed->doc->current_line = line;
+            ed->doc->cursor_x = found - text;
             update_status(ed, "Found");
             return;
         }
@@ -1224,13 +5745,30 @@ void find_text(Editor *ed) {
         start_pos = 0;
     }
     
+    // On through the rest of a paged file, and round from its top
+    if (v && view_find(ed, v->end, v->base + ed->doc->line_count, v->size, &hit, &col)) {
+        if (view_defer(ed, hit, col)) return;
+        ed->doc->current_line = get_line_at(ed, view_goto(ed, hit) + 1);
+        ed->doc->cursor_x = col;
+        update_status(ed, "Found");
+        return;
+    }
+    if (v && view_find(ed, v->data_start, 0, v->start, &hit, &col)) {
+        if (view_defer(ed, hit, col)) return;
+        ed->doc->current_line = get_line_at(ed, view_goto(ed, hit) + 1);
+        ed->doc->cursor_x = col;
+        update_status(ed, "Found (wrapped)");
+        return;
+    }
+    
     // Wrap around
-    line = ed->doc.first_line;
+    line = ed->doc->first_line;
     while (line != start_line) {
-        char *found = strstr(line->text, ed->find.find_text);
+        const char *text = line_peek(line);
+        const char *found = strstr(text, ed->find.find_text);
         if (found) {
-            ed->doc.current_line = line;
-            ed->doc.cursor_x = found - line->text;
+            ed->doc->current_line = line;
+            ed->doc->cursor_x = found - text;
             update_status(ed, "Found (wrapped)");
             return;
         }
@@ -1252,38 +5790,18 @@ void replace_text(Editor *ed) {
         return;
     }
     
-    Line *line = ed->doc.current_line;
+    Line *line = ed->doc->current_line;
     
     // Check if we're at a match
-    if (ed->doc.cursor_x + strlen(ed->find.find_text) <= line->length &&
-        strncmp(&line->text[ed->doc.cursor_x], ed->find.find_text, 
+    if (ed->doc->cursor_x + strlen(ed->find.find_text) <= line->length &&
+        strncmp(&line->text[ed->doc->cursor_x], ed->find.find_text, 
                 strlen(ed->find.find_text)) == 0) {
         
-        // Delete old text
-        int find_len = strlen(ed->find.find_text);
-        int replace_len = strlen(ed->find.replace_text);
-        
-        if (replace_len != find_len) {
-            // Adjust line length
-            int new_length = line->length - find_len + replace_len;
-            if (new_length >= line->capacity) {
-                line->capacity = new_length + 256;
-                line->text = (char *)realloc(line->text, line->capacity);
-            }
-            
-            // Move text
-            memmove(&line->text[ed->doc.cursor_x + replace_len],
-                    &line->text[ed->doc.cursor_x + find_len],
-                    line->length - ed->doc.cursor_x - find_len + 1);
-            line->length = new_length;
-        }
-        
-        // Insert replacement
-        memcpy(&line->text[ed->doc.cursor_x], ed->find.replace_text, replace_len);
-        ed->doc.modified = 1;
-        
-        // Move cursor past replacement
-        ed->doc.cursor_x += replace_len;
+        // Swap in the replacement and move the cursor past it
+        int x = ed->doc->cursor_x;
+        replace_range(ed, line, x, line, x + strlen(ed->find.find_text),
+                      ed->find.replace_text, strlen(ed->find.replace_text),
+                      NULL, &ed->doc->cursor_x);
     }
     
     // Find next occurrence
@@ -1291,27 +5809,29 @@ void replace_text(Editor *ed) {
 }
 
 // Go to line
-void goto_line(Editor *ed, int line_num) {
+void goto_line(Editor *ed, long long line_num) {
     if (line_num < 1) line_num = 1;
+    if (ed->doc->view && view_defer(ed, line_num - 1, 0)) return;
+    if (ed->doc->view) line_num = view_goto(ed, line_num - 1) + 1;
+    if (line_num > ed->doc->line_count) line_num = ed->doc->line_count;
     
-    ed->doc.current_line = ed->doc.first_line;
-    for (int i = 1; i < line_num && ed->doc.current_line->next; i++) {
-        ed->doc.current_line = ed->doc.current_line->next;
+    ed->doc->current_line = ed->doc->first_line;
+    for (int i = 1; i < line_num && ed->doc->current_line->next; i++) {
+        ed->doc->current_line = ed->doc->current_line->next;
     }
     
-    ed->doc.cursor_x = 0;
+    ed->doc->cursor_x = 0;
     
     // Adjust top line for visibility
-    int visible_lines = EDIT_END - EDIT_START + 1;
-    ed->top_line = line_num - visible_lines / 2;
+    ed->top_line = (int)line_num - ed->view_rows / 2;
     if (ed->top_line < 0) ed->top_line = 0;
 }
 
 // Set marker
 void set_marker(Editor *ed, int marker) {
     if (marker >= 0 && marker < MAX_MARKERS) {
-        ed->doc.markers[marker] = ed->doc.current_line;
-        ed->doc.marker_x[marker] = ed->doc.cursor_x;
+        ed->doc->markers[marker].line = ed->doc->current_line;
+        ed->doc->markers[marker].col = ed->doc->cursor_x;
         char msg[32];
         snprintf(msg, sizeof(msg), "Marker %d set", marker);
         update_status(ed, msg);
@@ -1320,9 +5840,10 @@ void set_marker(Editor *ed, int marker) {
 
 // Go to marker
 void goto_marker(Editor *ed, int marker) {
-    if (marker >= 0 && marker < MAX_MARKERS && ed->doc.markers[marker]) {
-        ed->doc.current_line = ed->doc.markers[marker];
-        ed->doc.cursor_x = ed->doc.marker_x[marker];
+    if (marker >= 0 && marker < MAX_MARKERS && ed->doc->markers[marker].line) {
+        Anchor *m = &ed->doc->markers[marker];
+        ed->doc->current_line = m->line;
+        ed->doc->cursor_x = m->col < m->line->length ? m->col : m->line->length;
         char msg[32];
         snprintf(msg, sizeof(msg), "At marker %d", marker);
         update_status(ed, msg);
@@ -1331,11 +5852,212 @@ void goto_marker(Editor *ed, int marker) {
     }
 }
 
+// Reflow output state: the line being filled and its word spans
+typedef struct {
+    char *buf;
+    int len;
+    int cols;  // Display width of buf
+    int cap;
+    int *word_start;
+    long *word_ink;
+    int words;
+    int word_cap;
+} Reflow;
+
+// Finish the line being filled as a right-sized Line, spreading spare
+// columns between words when justifying, and place any marks on it
+static Line *reflow_emit(Reflow *rf, const Format *fmt, int justify,
+                         ReflowMark *marks, int mark_count) {
+    int extra = justify && rf->words > 1 ? fmt->right_margin - rf->cols : 0;
+    if (extra < 0) extra = 0;
+    
+    Line *line = alloc_line(rf->len + extra + 1);
+    int gaps = rf->words - 1;
+    int src = 0;
+    int pos = 0;
+    
+    for (int w = 0; w < rf->words; w++) {
+        int from = rf->word_start[w];
+        int to = (w + 1 < rf->words) ? rf->word_start[w + 1] - 1 : rf->len;
+        
+        // Leading indent before the first word, single blank before the rest
+        if (w > 0) {
+            int pad = 1 + extra / gaps + (w <= extra % gaps ? 1 : 0);
+            memset(&line->text[pos], ' ', pad);
+            pos += pad;
+        } else {
+            memcpy(&line->text[pos], &rf->buf[src], from - src);
+            pos += from - src;
+        }
+        
+        for (int m = 0; m < mark_count; m++) {
+            long offset = marks[m].ink - rf->word_ink[w];
+            if (offset >= 0 && offset < to - from) {
+                marks[m].pos.line = line;
+                marks[m].pos.col = pos + (int)offset;
+                marks[m].ink = -1;  // Placed
+            }
+        }
+        
+        memcpy(&line->text[pos], &rf->buf[from], to - from);
+        pos += to - from;
+        src = to;
+    }
+    
+    line->text[pos] = '\0';
+    line->length = pos;
+    return line;
+}
+
+// Reflow the lines start..end into a detached chain of new lines using
+// the format margins. Words are streamed straight from the source lines,
+// so the cost is linear in the paragraph. Marks, which must lie on the
+// source lines, are moved to the same text in the output. Runs on worker
+// threads: it may only read the source lines' text and length, which must
+// be warm.
+Line *reflow_lines(const Format *fmt, Line *start, Line *end,
+                   ReflowMark *marks, int mark_count, int *count) {
+    Reflow rf;
+    Line *first = NULL;
+    Line *last = NULL;
+    long ink = 0;
+    int indent = fmt->paragraph_margin > 1 ? fmt->paragraph_margin - 1 : 0;
+    int left = fmt->left_margin > 1 ? fmt->left_margin - 1 : 0;
+    
+    rf.cap = fmt->right_margin + 64;
+    rf.buf = (char *)malloc(rf.cap);
+    rf.word_cap = 32;
+    rf.word_start = (int *)malloc(rf.word_cap * sizeof(int));
+    rf.word_ink = (long *)malloc(rf.word_cap * sizeof(long));
+    rf.words = 0;
+    rf.len = rf.cols = indent;
+    memset(rf.buf, ' ', indent);
+    *count = 0;
+    
+    for (Line *line = start; line; line = line->next) {
+        const char *text = line->text;
+        int i = 0;
+        
+        // Record how much text precedes each mark on this line
+        for (int m = 0; m < mark_count; m++) {
+            if (marks[m].pos.line == line) {
+                long before = ink;
+                for (int j = 0; j < marks[m].pos.col && j < line->length; j++) {
+                    if (text[j] != ' ' && text[j] != '\t') before++;
+                }
+                marks[m].ink = before;
+            }
+        }
+        
+        while (i < line->length) {
+            while (i < line->length && (text[i] == ' ' || text[i] == '\t')) i++;
+            if (i >= line->length) break;
+            
+            int word = i;
+            while (i < line->length && text[i] != ' ' && text[i] != '\t') i++;
+            int word_len = i - word;
+            int word_cols = text_width(&text[word], word_len);
+            
+            // Break before a word that would cross the right margin
+            if (rf.words > 0 && rf.cols + 1 + word_cols > fmt->right_margin) {
+                Line *new = reflow_emit(&rf, fmt, fmt->justify, marks, mark_count);
+                if (last) {
+                    last->next = new;
+                    new->prev = last;
+                } else {
+                    first = new;
+                }
+                last = new;
+                (*count)++;
+                
+                rf.words = 0;
+                rf.len = rf.cols = left;
+                memset(rf.buf, ' ', left);
+            }
+            
+            if (rf.len + word_len + 2 > rf.cap) {
+                rf.cap = (rf.len + word_len + 2) * 2;
+                rf.buf = (char *)realloc(rf.buf, rf.cap);
+            }
+            if (rf.words == rf.word_cap) {
+                rf.word_cap *= 2;
+                rf.word_start = (int *)realloc(rf.word_start, rf.word_cap * sizeof(int));
+                rf.word_ink = (long *)realloc(rf.word_ink, rf.word_cap * sizeof(long));
+            }
+            
+            if (rf.words > 0) {
+                rf.buf[rf.len++] = ' ';
+                rf.cols++;
+            }
+            rf.word_start[rf.words] = rf.len;
+            rf.word_ink[rf.words] = ink;
+            rf.words++;
+            memcpy(&rf.buf[rf.len], &text[word], word_len);
+            rf.len += word_len;
+            rf.cols += word_cols;
+            ink += word_len;
+        }
+        
+        if (line == end) break;
+    }
+    
+    // The last line is never justified
+    Line *new = reflow_emit(&rf, fmt, 0, marks, mark_count);
+    if (last) {
+        last->next = new;
+        new->prev = last;
+    } else {
+        first = new;
+    }
+    last = new;
+    (*count)++;
+    
+    // Marks after the last word go to the end of the paragraph
+    for (int m = 0; m < mark_count; m++) {
+        if (marks[m].ink >= 0) {
+            marks[m].pos.line = last;
+            marks[m].pos.col = last->length;
+        }
+    }
+    
+    free(rf.buf);
+    free(rf.word_start);
+    free(rf.word_ink);
+    return first;
+}
+
+// Replace lines start..end with a detached chain of count lines
+void replace_lines(Editor *ed, Line *start, Line *end, Line *lines, int count) {
+    Line *last = lines;
+    while (last->next) {
+        last = last->next;
+    }
+    
+    int removed = 0;
+    for (Line *line = start; line != end->next; line = line->next) removed++;
+    
+    link_lines(ed, end, lines, last, count);
+    unlink_lines(ed, start, end, removed);
+    
+    while (start) {
+        Line *next = start->next;
+        free_line(start);
+        start = next;
+    }
+    
+    ed->doc->modified = 1;
+}
+
 // Reform paragraph
 void reform_paragraph(Editor *ed) {
     // Find paragraph boundaries
-    Line *start = ed->doc.current_line;
-    Line *end = ed->doc.current_line;
+    Line *start = ed->doc->current_line;
+    Line *end = ed->doc->current_line;
+    
+    if (start->length == 0) {
+        update_status(ed, "No paragraph to reform");
+        return;
+    }
     
     // Find start of paragraph
     while (start->prev && start->prev->length > 0) {
@@ -1347,126 +6069,264 @@ void reform_paragraph(Editor *ed) {
         end = end->next;
     }
     
-    // Collect all text
-    int total_len = 0;
-    Line *line = start;
-    while (line) {
-        total_len += line->length + 1;
-        if (line == end) break;
-        line = line->next;
+    // Carry the cursor and any anchors in the paragraph through the reflow
+    ReflowMark *marks = (ReflowMark *)malloc((ed->doc->anchor_count + 1) * sizeof(ReflowMark));
+    Anchor **owners = (Anchor **)malloc((ed->doc->anchor_count + 1) * sizeof(Anchor *));
+    Anchor cursor;
+    int mark_count = collect_reflow_marks(ed, start, end, marks, owners, &cursor);
+    
+    int count;
+    warm_lines(start, end);
+    Line *lines = reflow_lines(&ed->format, start, end, marks, mark_count, &count);
+    replace_lines(ed, start, end, lines, count);
+    
+    for (int m = 0; m < mark_count; m++) {
+        *owners[m] = marks[m].pos;
+    }
+    free(marks);
+    free(owners);
+    ed->doc->current_line = cursor.line;
+    ed->doc->cursor_x = cursor.col;
+    
+    update_status(ed, "Paragraph reformed");
+}
+
+// Gather the anchors and the cursor lying on lines first..last as reflow
+// marks; owners[] says where each result goes back (the cursor's copy is
+// written to *cursor, which is preset to the current cursor)
+int collect_reflow_marks(Editor *ed, Line *first, Line *last, ReflowMark *marks,
+                         Anchor **owners, Anchor *cursor) {
+    int count = 0;
+    
+    cursor->line = ed->doc->current_line;
+    cursor->col = ed->doc->cursor_x;
+    
+    for (int i = 0; i <= ed->doc->anchor_count; i++) {
+        Anchor *a = (i < ed->doc->anchor_count) ? ed->doc->anchors[i] : cursor;
+        if (a->line && a->line->order >= first->order && a->line->order <= last->order) {
+            owners[count] = a;
+            marks[count].pos = *a;
+            marks[count++].ink = 0;
+        }
+    }
+    
+    return count;
+}
+
+// One paragraph of a multi-paragraph reform
+typedef struct {
+    Line *start;
+    Line *end;
+    ReflowMark *marks;
+    int mark_count;
+    Line *lines;  // Reflowed result
+    int count;
+} ReformJob;
+
+typedef struct {
+    const Format *format;
+    ReformJob *jobs;
+} ReformBatch;
+
+static void reform_job(void *ctx, int job) {
+    ReformBatch *batch = (ReformBatch *)ctx;
+    ReformJob *j = &batch->jobs[job];
+    j->lines = reflow_lines(batch->format, j->start, j->end, j->marks, j->mark_count, &j->count);
+}
+
+// Reform every paragraph in the block, or in the whole document when no
+// block is shown. Paragraphs are reflowed in parallel, each into its own
+// detached chain, and then spliced back in order on this thread.
+void reform_document(Editor *ed) {
+    Line *first = ed->doc->first_line;
+    Line *last = NULL;
+    int in_block = 0;
+    
+    if (ed->doc->block.active && ed->doc->block.start.line && ed->doc->block.end.line &&
+        ed->doc->block.start.line->order <= ed->doc->block.end.line->order) {
+        first = ed->doc->block.start.line;
+        last = ed->doc->block.end.line;
+        in_block = 1;
+    }
+    
+    LARGE_INTEGER freq, t0, t1;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t0);
+    
+    // Collect paragraphs: runs of non-blank lines, cut at the block ends
+    int job_count = 0;
+    int job_cap = 256;
+    ReformJob *jobs = (ReformJob *)malloc(job_cap * sizeof(ReformJob));
+    
+    for (Line *line = first; line; line = line->next) {
+        if (line->length > 0) {
+            Line *start = line;
+            while (line != last && line->next && line->next->length > 0) {
+                line = line->next;
+            }
+            // Workers read the text, so it must be unpacked here
+            warm_lines(start, line);
+            
+            if (job_count == job_cap) {
+                job_cap *= 2;
+                jobs = (ReformJob *)realloc(jobs, job_cap * sizeof(ReformJob));
+            }
+            jobs[job_count].start = start;
+            jobs[job_count].end = line;
+            jobs[job_count].marks = NULL;
+            jobs[job_count].mark_count = 0;
+            job_count++;
+        }
+        if (line == last) break;
+    }
+    
+    if (job_count == 0) {
+        free(jobs);
+        update_status(ed, "Nothing to reform");
+        return;
+    }
+    
+    // Give each paragraph the marks that fall in it, grouped by paragraph
+    int room = ed->doc->anchor_count + 1;
+    ReflowMark *marks = (ReflowMark *)malloc(room * sizeof(ReflowMark));
+    Anchor **owners = (Anchor **)malloc(room * sizeof(Anchor *));
+    int *mark_job = (int *)malloc(room * sizeof(int));
+    Anchor cursor;
+    int found = collect_reflow_marks(ed, jobs[0].start, jobs[job_count - 1].end,
+                                     marks, owners, &cursor);
+    int mark_count = 0;
+    
+    for (int m = 0; m < found; m++) {
+        unsigned long long key = marks[m].pos.line->order;
+        int lo = 0, hi = job_count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (jobs[mid].start->order <= key) lo = mid; else hi = mid - 1;
+        }
+        if (key > jobs[lo].end->order) continue;  // On a blank line
+        
+        ReflowMark mark = marks[m];
+        Anchor *owner = owners[m];
+        int at = mark_count++;
+        while (at > 0 && mark_job[at - 1] > lo) {
+            marks[at] = marks[at - 1];
+            owners[at] = owners[at - 1];
+            mark_job[at] = mark_job[at - 1];
+            at--;
+        }
+        marks[at] = mark;
+        owners[at] = owner;
+        mark_job[at] = lo;
+    }
+    for (int m = mark_count - 1; m >= 0; m--) {
+        jobs[mark_job[m]].marks = &marks[m];
+        jobs[mark_job[m]].mark_count++;
     }
     
-    char *para_text = (char *)malloc(total_len);
-    para_text[0] = '\0';
+    ReformBatch batch = { &ed->format, jobs };
+    run_jobs(job_count, PARALLEL_MIN_JOBS, reform_job, &batch);
     
-    line = start;
-    while (line) {
-        strcat(para_text, line->text);
-        if (line != end) strcat(para_text, " ");
-        if (line == end) break;
-        line = line->next;
+    for (int j = 0; j < job_count; j++) {
+        replace_lines(ed, jobs[j].start, jobs[j].end, jobs[j].lines, jobs[j].count);
     }
     
-    // Delete old lines (except first)
-    line = start->next;
-    while (line && line != end->next) {
-        Line *next = line->next;
-        
-        if (line->prev) line->prev->next = line->next;
-        if (line->next) line->next->prev = line->prev;
-        
-        free_line(line);
-        ed->doc.line_count--;
-        line = next;
+    for (int m = 0; m < mark_count; m++) {
+        *owners[m] = marks[m].pos;
     }
+    ed->doc->current_line = cursor.line;
+    ed->doc->cursor_x = cursor.col;
+    if (ed->doc->cursor_x > ed->doc->current_line->length) {
+        ed->doc->cursor_x = ed->doc->current_line->length;
+    }
+    free(jobs);
+    free(marks);
+    free(owners);
+    free(mark_job);
+    
+    QueryPerformanceCounter(&t1);
+    double secs = (double)(t1.QuadPart - t0.QuadPart) / (double)freq.QuadPart;
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s reformed: %d paragraphs in %.0f ms (%.0f paragraphs/sec)",
+             in_block ? "Block" : "Document", job_count, secs * 1000.0,
+             secs > 0 ? job_count / secs : (double)job_count);
+    update_status(ed, msg);
+}
+
+// Work queue shared by the job workers
+typedef struct {
+    void (*fn)(void *ctx, int job);
+    void *ctx;
+    volatile LONG next;
+    int jobs;
+} JobQueue;
+
+static unsigned __stdcall job_worker(void *arg) {
+    JobQueue *q = (JobQueue *)arg;
+    int job;
+    
+    while ((job = InterlockedIncrement(&q->next) - 1) < q->jobs) {
+        q->fn(q->ctx, job);
+    }
+    return 0;
+}
+
+// Run fn(ctx, 0..jobs-1) across a pool of worker threads, one per core,
+// with the calling thread taking jobs too; fewer than min_parallel jobs
+// run on the calling thread alone. Returns when all are done.
+void run_jobs(int jobs, int min_parallel, void (*fn)(void *ctx, int job), void *ctx) {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
     
-    // Reform into new lines
-    start->next = end->next;
-    if (end->next) end->next->prev = start;
+    int workers = (int)si.dwNumberOfProcessors;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    if (jobs < min_parallel) workers = 1;
     
-    char *word = strtok(para_text, " ");
-    start->text[0] = '\0';
-    start->length = 0;
+    JobQueue q = { fn, ctx, 0, jobs };
+    HANDLE threads[MAX_WORKERS];
+    int started = 0;
     
-    // Add initial indent
-    for (int i = 0; i < ed->format.paragraph_margin - 1; i++) {
-        start->text[start->length++] = ' ';
+    for (int i = 1; i < workers; i++) {
+        HANDLE h = (HANDLE)_beginthreadex(NULL, 0, job_worker, &q, 0, NULL);
+        if (!h) break;
+        threads[started++] = h;
     }
     
-    Line *curr = start;
+    job_worker(&q);
     
-    while (word) {
-        int word_len = strlen(word);
-        
-        if (curr->length > ed->format.left_margin - 1 && 
-            curr->length + word_len + 1 > ed->format.right_margin) {
-            // Create new line
-            Line *new = create_line();
-            new->prev = curr;
-            new->next = curr->next;
-            if (curr->next) curr->next->prev = new;
-            curr->next = new;
-            curr = new;
-            ed->doc.line_count++;
-            
-            // Add left margin
-            for (int i = 0; i < ed->format.left_margin - 1; i++) {
-                curr->text[curr->length++] = ' ';
-            }
-        }
-        
-        if (curr->length > ed->format.left_margin - 1) {
-            curr->text[curr->length++] = ' ';
+    if (started > 0) {
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+        for (int i = 0; i < started; i++) {
+            CloseHandle(threads[i]);
         }
-        
-        strcpy(&curr->text[curr->length], word);
-        curr->length += word_len;
-        curr->text[curr->length] = '\0';
-        
-        word = strtok(NULL, " ");
     }
-    
-    free(para_text);
-    ed->doc.modified = 1;
-    update_status(ed, "Paragraph reformed");
 }
 
 // Center line
 void center_line(Editor *ed) {
-    Line *line = ed->doc.current_line;
+    Line *line = ed->doc->current_line;
     
     // Remove leading/trailing spaces
     int start = 0;
-    while (start < line->length && isspace(line->text[start])) start++;
+    while (start < line->length && isspace((unsigned char)line->text[start])) start++;
     
     int end = line->length - 1;
-    while (end > start && isspace(line->text[end])) end--;
+    while (end > start && isspace((unsigned char)line->text[end])) end--;
     
     if (start <= end) {
         int text_len = end - start + 1;
         int margin = (ed->format.right_margin - ed->format.left_margin - text_len) / 2;
         if (margin < 0) margin = 0;
         
-        // Build centered line
-        char *new_text = (char *)malloc(line->capacity);
-        int pos = 0;
+        // Left margin and centering spaces replace the leading blanks
+        int indent = ed->format.left_margin - 1 + margin;
+        char *spaces = (char *)malloc(indent + 1);
+        memset(spaces, ' ', indent);
         
-        // Add left margin and centering spaces
-        for (int i = 0; i < ed->format.left_margin - 1 + margin; i++) {
-            new_text[pos++] = ' ';
-        }
-        
-        // Add text
-        memcpy(&new_text[pos], &line->text[start], text_len);
-        pos += text_len;
-        new_text[pos] = '\0';
+        delete_range(ed, line, end + 1, line, line->length);
+        replace_range(ed, line, 0, line, start, spaces, indent, NULL, NULL);
+        free(spaces);
         
-        // Replace line text
-        strcpy(line->text, new_text);
-        line->length = pos;
-        free(new_text);
-        
-        ed->doc.modified = 1;
+        if (ed->doc->cursor_x > line->length) ed->doc->cursor_x = line->length;
         update_status(ed, "Line centered");
     }
 }
@@ -1477,10 +6337,36 @@ void update_status(Editor *ed, const char *msg) {
     ed->status_msg[sizeof(ed->status_msg) - 1] = '\0';
 }
 
+// ASCII character of a key, or 0 for other characters. Input is read as
+// UTF-16, so a plain AsciiChar would alias the low byte of any character.
+char key_char(KEY_EVENT_RECORD *key) {
+    return key->uChar.UnicodeChar < 0x80 ? (char)key->uChar.UnicodeChar : 0;
+}
+
+// Whether a key event is Shift, Ctrl or Alt going down on its own
+static int is_modifier_key(KEY_EVENT_RECORD *key) {
+    WORD vk = key->wVirtualKeyCode;
+    return vk == VK_SHIFT || vk == VK_CONTROL || vk == VK_MENU;
+}
+
 // Process key input
 void process_key(Editor *ed, KEY_EVENT_RECORD *key) {
     if (!key->bKeyDown) return;
     
+    if (ed->recording && !ed->playing) record_key(ed, key);
+    // A modifier alone does nothing, and leaves a ^K, ^Q, ^O or ^P pending
+    if (is_modifier_key(key)) return;
+    // Any other key calls off a jump waiting on the index
+    if (ed->doc->view) ed->doc->view->pending = -1;
+    line_warm(ed->doc->current_line);
+    
+    if (ed->doc->view && !view_allows(ed, key)) {
+        ed->state = STATE_NORMAL;
+        update_status(ed, "Read-only view");
+        return;
+    }
+    view_follow(ed);
+    
     // Handle input states
     if (ed->state >= STATE_FIND && ed->state <= STATE_SAVE_AS) {
         handle_input_state(ed, key);
@@ -1503,13 +6389,196 @@ void process_key(Editor *ed, KEY_EVENT_RECORD *key) {
         case STATE_CTRL_P:
             handle_ctrl_p(ed, key);
             break;
+        case STATE_CONFIRM:
+            handle_confirm(ed, key);
+            break;
+    }
+    view_follow(ed);
+}
+
+// Whether a key event would type text: a printable character, Enter or Tab
+static int is_text_key(KEY_EVENT_RECORD *key) {
+    WCHAR c = key->uChar.UnicodeChar;
+    
+    if (key->dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) return 0;
+    return key->wVirtualKeyCode == VK_RETURN || key->wVirtualKeyCode == VK_TAB ||
+           (c >= 32 && c < 127) || c >= 0xA0;
+}
+
+// Whether a key may be used on a paged file: anything but editing
+int view_allows(Editor *ed, KEY_EVENT_RECORD *key) {
+    char ch = toupper(key_char(key));
+    WORD vk = key->wVirtualKeyCode;
+    
+    switch (ed->state) {
+        case STATE_NORMAL:
+            if (key->dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) {
+                return !ch || !strchr("GHTYNBP", ch + '@');
+            }
+            return !is_text_key(key) && vk != VK_DELETE && vk != VK_BACK;
+        case STATE_CTRL_K:
+            return !ch || !strchr("SDCVYR", ch);
+        case STATE_CTRL_Q:
+            return !ch || !strchr("AYU", ch);
+        case STATE_CTRL_O:
+            return ch != 'C';
+        case STATE_CTRL_P:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+// Paged files still being indexed
+int views_scanning(Editor *ed) {
+    int count = 0;
+    
+    for (int i = 0; i < ed->doc_count; i++) {
+        if (ed->docs[i]->view && !ed->docs[i]->view->scanned) count++;
+    }
+    return count;
+}
+
+// The console delivers a paste as a stream of key events. When a read
+// starts with more typed characters than anyone types between two reads,
+// insert them with insert_string() instead of one key at a time. Returns the
+// number of events used, 0 if they weren't a paste.
+int paste_burst(Editor *ed, INPUT_RECORD *inputs, int count) {
+    int chars = 0, n = 0;
+    
+    if (ed->state != STATE_NORMAL || !ed->insert_mode || ed->recording || ed->high_surrogate ||
+        ed->doc->view) {
+        return 0;
+    }
+    
+    while (n < count && inputs[n].EventType == KEY_EVENT) {
+        KEY_EVENT_RECORD *key = &inputs[n].Event.KeyEvent;
+        if (key->bKeyDown) {
+            if (!is_text_key(key)) break;
+            chars += key->wRepeatCount ? key->wRepeatCount : 1;
+        }
+        n++;
+    }
+    if (chars < PASTE_MIN_CHARS) return 0;
+    
+    // Tabs expand to spaces up to the tab width
+    char *text = (char *)malloc(chars * (ed->format.tab_width > 4 ? ed->format.tab_width : 4));
+    int len = 0;
+    int col = line_col(ed, ed->doc->current_line, ed->doc->cursor_x);
+    
+    for (int i = 0; i < n; i++) {
+        KEY_EVENT_RECORD *key = &inputs[i].Event.KeyEvent;
+        if (!key->bKeyDown) continue;
+        
+        for (int r = key->wRepeatCount ? key->wRepeatCount : 1; r > 0; r--) {
+            unsigned cp = key->uChar.UnicodeChar;
+            
+            if (key->wVirtualKeyCode == VK_RETURN) {
+                text[len++] = '\n';
+                col = 0;
+                continue;
+            } else if (key->wVirtualKeyCode == VK_TAB) {
+                do {
+                    text[len++] = ' ';
+                } while (++col % ed->format.tab_width != 0);
+                continue;
+            } else if (cp >= 0xD800 && cp < 0xDC00) {
+                // Pair it with the low half that follows
+                WCHAR low = 0;
+                while (i + 1 < n && !inputs[i + 1].Event.KeyEvent.bKeyDown) i++;
+                if (i + 1 < n) low = inputs[i + 1].Event.KeyEvent.uChar.UnicodeChar;
+                if (low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    i++;
+                } else {
+                    cp = 0xFFFD;
+                }
+            } else if (cp >= 0xDC00 && cp < 0xE000) {
+                cp = 0xFFFD;
+            }
+            len += utf8_encode(cp, &text[len]);
+            col += char_width(cp);
+        }
+    }
+    
+    insert_string(ed, ed->doc->current_line, ed->doc->cursor_x, text, len,
+                  &ed->doc->current_line, &ed->doc->cursor_x);
+    free(text);
+    return n;
+}
+
+// Append a key to the macro being recorded
+void record_key(Editor *ed, KEY_EVENT_RECORD *key) {
+    if (ed->macro_len == ed->macro_cap) {
+        ed->macro_cap = ed->macro_cap ? ed->macro_cap * 2 : 64;
+        ed->macro = (KEY_EVENT_RECORD *)realloc(ed->macro, ed->macro_cap * sizeof(KEY_EVENT_RECORD));
+    }
+    ed->macro[ed->macro_len++] = *key;
+}
+
+// Drop the ^K chord just recorded, along with the modifier keys pressed
+// for it
+void unrecord_chord(Editor *ed) {
+    int n = ed->macro_len > 0 ? ed->macro_len - 1 : 0;
+    while (n > 0 && is_modifier_key(&ed->macro[n - 1])) n--;
+    if (n > 0 && key_char(&ed->macro[n - 1]) == CTRL_K) n--;
+    while (n > 0 && is_modifier_key(&ed->macro[n - 1])) n--;
+    ed->macro_len = n;
+}
+
+// Start recording a macro, or stop and keep it
+void toggle_recording(Editor *ed) {
+    if (ed->recording) {
+        // The ^K M that stopped the recording isn't part of it
+        unrecord_chord(ed);
+        ed->recording = 0;
+        update_status(ed, "Macro recorded");
+    } else {
+        ed->macro_len = 0;
+        ed->recording = 1;
+        update_status(ed, "Recording macro - ^KM to stop");
+    }
+}
+
+// Replay the macro a number of times. Keys go through process_key as if
+// typed, but nothing is drawn until the end: the main loop repaints once
+// after the whole playback.
+void play_macro(Editor *ed, int times) {
+    LARGE_INTEGER freq, t0, t1;
+    char msg[80];
+    
+    if (ed->recording) {
+        update_status(ed, "Cannot play a macro while recording");
+        return;
+    }
+    if (ed->macro_len == 0) {
+        update_status(ed, "No macro recorded");
+        return;
+    }
+    
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t0);
+    
+    ed->playing = 1;
+    for (int n = 0; n < times; n++) {
+        for (int i = 0; i < ed->macro_len; i++) {
+            process_key(ed, &ed->macro[i]);
+            scroll_to_cursor(ed);
+        }
     }
+    ed->playing = 0;
+    ed->state = STATE_NORMAL;
+    
+    QueryPerformanceCounter(&t1);
+    snprintf(msg, sizeof(msg), "Macro played %d times in %.0f ms", times,
+             (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart);
+    update_status(ed, msg);
 }
 
 // Handle input states (find, replace, etc.)
 void handle_input_state(Editor *ed, KEY_EVENT_RECORD *key) {
     WORD vk = key->wVirtualKeyCode;
-    char ch = key->uChar.AsciiChar;
+    char ch = key_char(key);
     
     if (vk == VK_ESCAPE) {
         ed->state = STATE_NORMAL;
@@ -1531,11 +6600,45 @@ void handle_input_state(Editor *ed, KEY_EVENT_RECORD *key) {
                 break;
             case STATE_GOTO_LINE:
                 {
-                    int line_num = atoi(ed->input_buffer);
+                    long long line_num = atoll(ed->input_buffer);
                     ed->state = STATE_NORMAL;
                     goto_line(ed, line_num);
                 }
                 break;
+            case STATE_WRITE_BLOCK:
+                ed->state = STATE_NORMAL;
+                write_block(ed, ed->input_buffer);
+                break;
+            case STATE_READ_FILE:
+                ed->state = STATE_NORMAL;
+                read_block(ed, ed->input_buffer);
+                break;
+            case STATE_OPEN_FILE:
+                ed->state = STATE_NORMAL;
+                if (ed->input_buffer[0]) open_buffer(ed, ed->input_buffer);
+                break;
+            case STATE_MACRO_COUNT:
+                {
+                    int times = ed->input_buffer[0] ? atoi(ed->input_buffer) : 1;
+                    ed->state = STATE_NORMAL;
+                    if (times > 0) play_macro(ed, times);
+                }
+                break;
+            case STATE_PICK_BUFFER:
+                {
+                    int num = atoi(ed->input_buffer);
+                    ed->state = STATE_NORMAL;
+                    if (num >= 1 && num <= ed->doc_count) {
+                        switch_buffer(ed, num - 1);
+                    } else {
+                        update_status(ed, "No such buffer");
+                    }
+                }
+                break;
+            case STATE_COMPARE:
+                ed->state = STATE_NORMAL;
+                compare_with(ed, ed->input_buffer);
+                break;
             case STATE_SAVE_AS:
                 ed->state = STATE_NORMAL;
                 save_file_as(ed, ed->input_buffer);
@@ -1547,18 +6650,25 @@ void handle_input_state(Editor *ed, KEY_EVENT_RECORD *key) {
     }
     
     if (vk == VK_BACK && ed->input_pos > 0) {
-        ed->input_pos--;
+        // Remove a whole UTF-8 character
+        do {
+            ed->input_pos--;
+        } while (ed->input_pos > 0 && (ed->input_buffer[ed->input_pos] & 0xC0) == 0x80);
         ed->input_buffer[ed->input_pos] = '\0';
     } else if (ch >= 32 && ch < 127 && ed->input_pos < sizeof(ed->input_buffer) - 1) {
         ed->input_buffer[ed->input_pos++] = ch;
         ed->input_buffer[ed->input_pos] = '\0';
+    } else if (key->uChar.UnicodeChar >= 0xA0 && (key->uChar.UnicodeChar < 0xD800 || key->uChar.UnicodeChar >= 0xE000) &&
+               ed->input_pos < sizeof(ed->input_buffer) - 4) {
+        ed->input_pos += utf8_encode(key->uChar.UnicodeChar, &ed->input_buffer[ed->input_pos]);
+        ed->input_buffer[ed->input_pos] = '\0';
     }
 }
 
 // Handle normal state keys
 void handle_normal_key(Editor *ed, KEY_EVENT_RECORD *key) {
     WORD vk = key->wVirtualKeyCode;
-    char ch = key->uChar.AsciiChar;
+    char ch = key_char(key);
     
     // Check for control keys
     if (key->dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) {
@@ -1673,9 +6783,19 @@ void handle_normal_key(Editor *ed, KEY_EVENT_RECORD *key) {
                 break;
             case VK_TAB:
                 // Insert spaces to next tab stop
-                do {
-                    insert_char(ed, ' ');
-                } while (ed->doc.cursor_x % ed->format.tab_width != 0);
+                if (ed->insert_mode) {
+                    char spaces[64];
+                    int col = line_col(ed, ed->doc->current_line, ed->doc->cursor_x);
+                    int n = ed->format.tab_width - col % ed->format.tab_width;
+                    if (n > (int)sizeof(spaces)) n = sizeof(spaces);
+                    memset(spaces, ' ', n);
+                    insert_text(ed, spaces, n);
+                } else {
+                    do {
+                        insert_char(ed, ' ');
+                    } while (line_col(ed, ed->doc->current_line, ed->doc->cursor_x) %
+                             ed->format.tab_width != 0);
+                }
                 break;
             case VK_INSERT:
                 ed->insert_mode = !ed->insert_mode;
@@ -1684,6 +6804,17 @@ void handle_normal_key(Editor *ed, KEY_EVENT_RECORD *key) {
             default:
                 if (ch >= 32 && ch < 127) {
                     insert_char(ed, ch);
+                } else if (key->uChar.UnicodeChar >= 0xD800 && key->uChar.UnicodeChar < 0xDC00) {
+                    // First half of a character beyond the BMP
+                    ed->high_surrogate = key->uChar.UnicodeChar;
+                } else if (key->uChar.UnicodeChar >= 0xDC00 && key->uChar.UnicodeChar < 0xE000) {
+                    if (ed->high_surrogate) {
+                        insert_codepoint(ed, 0x10000 + ((ed->high_surrogate - 0xD800) << 10) +
+                                             (key->uChar.UnicodeChar - 0xDC00));
+                    }
+                    ed->high_surrogate = 0;
+                } else if (key->uChar.UnicodeChar >= 0xA0) {
+                    insert_codepoint(ed, key->uChar.UnicodeChar);
                 }
                 break;
         }
@@ -1692,26 +6823,56 @@ void handle_normal_key(Editor *ed, KEY_EVENT_RECORD *key) {
 
 // Handle Ctrl-K menu
 void handle_ctrl_k(Editor *ed, KEY_EVENT_RECORD *key) {
-    char ch = toupper(key->uChar.AsciiChar);
+    char ch = toupper(key_char(key));
     
     switch (ch) {
-        case 'S':  // Save
-            save_file(ed);
+        case 'S':  // Save, carrying on while it is written
+            if (ask_overwrite(ed, CONFIRM_OVERWRITE)) return;
+            start_save(ed);
             break;
         case 'D':  // Done (save and continue)
-            save_file(ed);
+            if (ask_overwrite(ed, CONFIRM_OVERWRITE)) return;
+            start_save(ed);
             break;
-        case 'X':  // Exit
-            if (ed->doc.modified) {
-                update_status(ed, "Save changes? (Y/N)");
-                // Simple prompt - in real implementation would wait for Y/N
+        case 'X':  // Exit (closes this file if others are open)
+            if (ed->doc->modified) {
+                if (ask_overwrite(ed, CONFIRM_EXIT)) return;
                 save_file(ed);
             }
-            exit(0);
+            close_buffer(ed, 0);
             break;
         case 'Q':  // Quit without save
-            exit(0);
+            close_buffer(ed, 1);
+            break;
+        case 'E':  // Edit another file
+            ed->state = STATE_OPEN_FILE;
+            ed->input_buffer[0] = '\0';
+            ed->input_pos = 0;
+            update_status(ed, "Edit file:");
+            return;  // Stay in submenu
+        case 'U':  // Next buffer
+            switch_buffer(ed, (buffer_index(ed) + 1) % ed->doc_count);
+            break;
+        case 'L':  // Buffer list
+            pick_buffer(ed);
+            return;
+        case 'M':  // Record macro
+            toggle_recording(ed);
             break;
+        case 'P':  // Play macro
+            if (ed->playing) break;  // A macro cannot replay itself
+            if (ed->recording) {
+                // Refused before the count prompt, so neither the chord
+                // nor a count ends up in the macro
+                unrecord_chord(ed);
+                update_status(ed, "Cannot play a macro while recording");
+                break;
+            }
+            ed->state = STATE_MACRO_COUNT;
+            ed->input_buffer[0] = '\0';
+            ed->input_pos = 0;
+            update_status(ed, "Play macro how many times:");
+            return;
         case 'B':  // Block begin
             mark_block_begin(ed);
             break;
@@ -1730,18 +6891,24 @@ void handle_ctrl_k(Editor *ed, KEY_EVENT_RECORD *key) {
         case 'H':  // Hide block
             hide_block(ed);
             break;
+        case 'N':  // Column block mode
+            toggle_column_mode(ed);
+            break;
         case 'W':  // Write block
-            ed->state = STATE_SAVE_AS;
+            ed->state = STATE_WRITE_BLOCK;
             ed->input_buffer[0] = '\0';
             ed->input_pos = 0;
             update_status(ed, "Write block to file:");
             return;  // Stay in submenu
         case 'R':  // Read file
-            ed->state = STATE_SAVE_AS;
+            ed->state = STATE_READ_FILE;
             ed->input_buffer[0] = '\0';
             ed->input_pos = 0;
             update_status(ed, "Read file:");
             return;  // Stay in submenu
+        case '?':  // Memory and compression stats
+            show_memory(ed);
+            break;
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
             // Set marker
@@ -1754,7 +6921,7 @@ void handle_ctrl_k(Editor *ed, KEY_EVENT_RECORD *key) {
 
 // Handle Ctrl-Q menu
 void handle_ctrl_q(Editor *ed, KEY_EVENT_RECORD *key) {
-    char ch = toupper(key->uChar.AsciiChar);
+    char ch = toupper(key_char(key));
     
     switch (ch) {
         case 'F':  // Find
@@ -1776,23 +6943,37 @@ void handle_ctrl_q(Editor *ed, KEY_EVENT_RECORD *key) {
             move_doc_end(ed);
             break;
         case 'B':  // Beginning of block
-            if (ed->block.active && ed->block.start_line) {
-                ed->doc.current_line = ed->block.start_line;
-                ed->doc.cursor_x = ed->block.start_col;
+            if (ed->doc->block.active && ed->doc->block.start.line) {
+                Anchor *a = &ed->doc->block.start;
+                ed->doc->current_line = a->line;
+                ed->doc->cursor_x = a->col < a->line->length ? a->col : a->line->length;
             }
             break;
         case 'K':  // End of block
-            if (ed->block.active && ed->block.end_line) {
-                ed->doc.current_line = ed->block.end_line;
-                ed->doc.cursor_x = ed->block.end_col;
+            if (ed->doc->block.active && ed->doc->block.end.line) {
+                Anchor *a = &ed->doc->block.end;
+                ed->doc->current_line = a->line;
+                ed->doc->cursor_x = a->col < a->line->length ? a->col : a->line->length;
             }
             break;
         case 'Y':  // Delete to end of line
             delete_to_eol(ed);
             break;
+        case 'U':  // Reform block or whole document
+            reform_document(ed);
+            break;
         case 'L':  // Restore line (undo - simplified)
             update_status(ed, "Undo not implemented");
             break;
+        case 'T':  // Follow the file as it grows
+            toggle_follow(ed);
+            break;
+        case 'N':  // Next difference
+            next_difference(ed, 0);
+            break;
+        case 'P':  // Previous difference
+            next_difference(ed, 1);
+            break;
         case 'I':  // Go to line
             ed->state = STATE_GOTO_LINE;
             ed->input_buffer[0] = '\0';
@@ -1811,19 +6992,19 @@ void handle_ctrl_q(Editor *ed, KEY_EVENT_RECORD *key) {
 
 // Handle Ctrl-O menu (Format)
 void handle_ctrl_o(Editor *ed, KEY_EVENT_RECORD *key) {
-    char ch = toupper(key->uChar.AsciiChar);
+    char ch = toupper(key_char(key));
     
     switch (ch) {
         case 'L':  // Set left margin
-            ed->format.left_margin = ed->doc.cursor_x + 1;
+            ed->format.left_margin = line_col(ed, ed->doc->current_line, ed->doc->cursor_x) + 1;
             update_status(ed, "Left margin set");
             break;
         case 'R':  // Set right margin
-            ed->format.right_margin = ed->doc.cursor_x + 1;
+            ed->format.right_margin = line_col(ed, ed->doc->current_line, ed->doc->cursor_x) + 1;
             update_status(ed, "Right margin set");
             break;
         case 'P':  // Set paragraph margin
-            ed->format.paragraph_margin = ed->doc.cursor_x + 1;
+            ed->format.paragraph_margin = line_col(ed, ed->doc->current_line, ed->doc->cursor_x) + 1;
             update_status(ed, "Paragraph margin set");
             break;
         case 'W':  // Toggle word wrap
@@ -1837,6 +7018,20 @@ void handle_ctrl_o(Editor *ed, KEY_EVENT_RECORD *key) {
         case 'C':  // Center line
             center_line(ed);
             break;
+        case 'V':  // Toggle soft wrap
+            toggle_soft_wrap(ed);
+            break;
+        case 'D':  // Compare with another buffer or file
+            if (ed->doc->compared) {
+                stop_compare(ed);
+                update_status(ed, "Compare OFF");
+                break;
+            }
+            ed->state = STATE_COMPARE;
+            ed->input_buffer[0] = '\0';
+            ed->input_pos = 0;
+            update_status(ed, "Compare with buffer number or file (Enter for the file on disk):");
+            return;  // Stay in submenu
         case 'T':  // Toggle ruler
             ed->show_ruler = !ed->show_ruler;
             update_status(ed, ed->show_ruler ? "Ruler ON" : "Ruler OFF");
@@ -1850,6 +7045,15 @@ void handle_ctrl_o(Editor *ed, KEY_EVENT_RECORD *key) {
             ed->auto_indent = !ed->auto_indent;
             update_status(ed, ed->auto_indent ? "Auto-indent ON" : "Auto-indent OFF");
             break;
+        case 'K':  // Open a window
+            split_window(ed);
+            break;
+        case 'G':  // Go to the next window
+            next_window(ed);
+            break;
+        case 'U':  // Close this window
+            close_window(ed);
+            break;
     }
     
     ed->state = STATE_NORMAL;
@@ -1857,7 +7061,7 @@ void handle_ctrl_o(Editor *ed, KEY_EVENT_RECORD *key) {
 
 // Handle Ctrl-P menu (Print formatting)
 void handle_ctrl_p(Editor *ed, KEY_EVENT_RECORD *key) {
-    char ch = toupper(key->uChar.AsciiChar);
+    char ch = toupper(key_char(key));
     
     // In a real implementation, these would insert formatting codes
     switch (ch) {
@@ -1887,71 +7091,403 @@ void handle_ctrl_p(Editor *ed, KEY_EVENT_RECORD *key) {
 
 // Cleanup
 void cleanup_editor(Editor *ed) {
-    // Free all lines
-    Line *line = ed->doc.first_line;
-    while (line) {
-        Line *next = line->next;
-        free_line(line);
-        line = next;
+    free_editor(ed);
+    restore_console(ed);
+}
+
+// Free everything the editor holds
+void free_editor(Editor *ed) {
+    // Free all buffers
+    for (int i = 0; i < ed->doc_count; i++) {
+        free_document(ed->docs[i]);
     }
     
-    // Free clipboard
+    // Free clipboard and macro
     clear_clipboard(ed);
+    free(ed->macro);
+}
+
+// Turn a batch script into key events. Keys are written as typed, with
+// ^X for a control key (^M is Enter, ^I Tab, ^H Backspace, ^[ Escape and
+// ^^ a caret). Line breaks are ignored; a line starting with a count and
+// '*' is repeated that many times, and lines starting with ';' are comments.
+// Returns the number of keys, or -1 after printing what is wrong.
+int parse_script(const char *text, long len, KEY_EVENT_RECORD **keys) {
+    KEY_EVENT_RECORD *out = NULL;
+    int count = 0, cap = 0;
+    int line_no = 1;
+    long i = 0;
     
-    restore_console(ed);
+    while (i < len) {
+        long end = i;
+        while (end < len && text[end] != '\n' && text[end] != '\r') end++;
+        
+        int repeat = 1;
+        long start = i;
+        if (text[i] == ';') start = end;
+        if (isdigit((unsigned char)text[i])) {
+            long j = i;
+            while (j < end && isdigit((unsigned char)text[j])) j++;
+            if (j < end && text[j] == '*') {
+                repeat = atoi(&text[i]);
+                start = j + 1;
+            }
+        }
+        
+        for (int r = 0; r < repeat; r++) {
+            for (long k = start; k < end; ) {
+                KEY_EVENT_RECORD key;
+                unsigned cp;
+                
+                memset(&key, 0, sizeof(key));
+                key.bKeyDown = TRUE;
+                key.wRepeatCount = 1;
+                
+                if (text[k] == '^' && k + 1 == end) {
+                    fprintf(stderr, "Script line %d: ^ at end of line\n", line_no);
+                    free(out);
+                    return -1;
+                }
+                if (text[k] == '^' && text[k + 1] != '^') {
+                    char c = toupper((unsigned char)text[k + 1]);
+                    k += 2;
+                    if (c == 'M') {
+                        key.wVirtualKeyCode = VK_RETURN;
+                        key.uChar.UnicodeChar = '\r';
+                    } else if (c == '[') {
+                        key.wVirtualKeyCode = VK_ESCAPE;
+                        key.uChar.UnicodeChar = 27;
+                    } else if (c == 'I') {
+                        key.wVirtualKeyCode = VK_TAB;
+                        key.uChar.UnicodeChar = '\t';
+                    } else if (c == 'H') {
+                        key.wVirtualKeyCode = VK_BACK;
+                        key.uChar.UnicodeChar = 8;
+                    } else {
+                        key.wVirtualKeyCode = c;
+                        key.uChar.UnicodeChar = c & 0x1F;
+                        key.dwControlKeyState = LEFT_CTRL_PRESSED;
+                    }
+                } else {
+                    if (text[k] == '^') k++;  // ^^
+                    int n = utf8_decode(&text[k], (int)(end - k), &cp);
+                    if (!n) {
+                        n = 1;
+                        cp = 0xFFFD;
+                    }
+                    k += n;
+                    key.uChar.UnicodeChar = (WCHAR)(cp < 0x10000 ? cp : 0xFFFD);
+                }
+                
+                if (count == cap) {
+                    KEY_EVENT_RECORD *grown;
+                    cap = cap ? cap * 2 : 64;
+                    grown = (KEY_EVENT_RECORD *)realloc(out, cap * sizeof(KEY_EVENT_RECORD));
+                    if (!grown) {
+                        fprintf(stderr, "Script too long: out of memory\n");
+                        free(out);
+                        return -1;
+                    }
+                    out = grown;
+                }
+                out[count++] = key;
+            }
+        }
+        
+        i = end;
+        while (i < len && (text[i] == '\n' || text[i] == '\r')) {
+            if (text[i++] == '\n') line_no++;
+        }
+    }
+    
+    *keys = out;
+    return count;
+}
+
+// One file of a batch run
+typedef struct {
+    const char *filename;
+    int failed;
+    int modified;
+    int lines_before;
+    int lines_after;
+    double ms;
+    char status[256];  // Last message from the script
+} BatchFile;
+
+typedef struct {
+    KEY_EVENT_RECORD *keys;
+    int key_count;
+    BatchFile *files;
+} BatchRun;
+
+// Apply the script to one file in an editor of its own, saving it if the
+// script changed it
+static void batch_file(void *ctx, int job) {
+    BatchRun *run = (BatchRun *)ctx;
+    BatchFile *f = &run->files[job];
+    Editor *ed = (Editor *)malloc(sizeof(Editor));
+    LARGE_INTEGER freq, t0, t1;
+    
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t0);
+    
+    init_editor(ed);
+    ed->batch = 1;
+    ed->journal_off = 1;
+    ed->playing = 1;
+    
+    FILE *fp = fopen(f->filename, "rb");
+    if (fp) {
+        fclose(fp);
+        load_file(ed, f->filename);
+    }
+    if (!fp) {
+        f->failed = 1;
+        strcpy(f->status, "Cannot open file");
+    } else if (strcmp(ed->doc->filename, f->filename) != 0) {
+        // Opened but not loaded, being too big to hold
+        f->failed = 1;
+        strcpy(f->status, ed->status_msg);
+    } else {
+        f->lines_before = ed->doc->line_count;
+        ed->status_msg[0] = '\0';
+        
+        for (int i = 0; i < run->key_count && !ed->quit; i++) {
+            process_key(ed, &run->keys[i]);
+            scroll_to_cursor(ed);
+            f->modified |= ed->doc->modified;
+        }
+        finish_save(ed, ed->doc);
+        
+        strcpy(f->status, ed->status_msg);
+        f->lines_after = ed->doc->line_count;
+        if (ed->quit == QUIT_ABANDON && ed->doc->modified) {
+            // ^KQ abandons the edits
+            f->modified = 0;
+            f->lines_after = f->lines_before;
+            strcpy(f->status, "Changes abandoned");
+        } else if (ed->quit == QUIT_EXIT && ed->doc->modified) {
+            // ^KX couldn't save; the status says why
+            f->failed = 1;
+        } else if (ed->doc->modified) {
+            save_file(ed);
+            if (ed->doc->modified) {
+                f->failed = 1;
+                strcpy(f->status, ed->status_msg);
+            }
+        }
+    }
+    
+    free_editor(ed);
+    free(ed);
+    QueryPerformanceCounter(&t1);
+    f->ms = (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+}
+
+// Run a script of WordStar keys over files without a console, several
+// files at a time, and print what happened to each. Returns the exit
+// status: 1 if any file could not be read or saved.
+int run_batch(const char *script, int file_count, char **filenames) {
+    BatchRun run;
+    LARGE_INTEGER freq, t0, t1;
+    long size;
+    int changed = 0, failed = 0;
+    
+    char *text = read_file_data(script, &size);
+    if (!text) {
+        fprintf(stderr, "Cannot read script %s\n", script);
+        return 1;
+    }
+    run.key_count = parse_script(text, size, &run.keys);
+    free(text);
+    if (run.key_count < 0) return 1;
+    
+    run.files = (BatchFile *)calloc(file_count, sizeof(BatchFile));
+    for (int i = 0; i < file_count; i++) {
+        run.files[i].filename = filenames[i];
+    }
+    
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t0);
+    run_jobs(file_count, 2, batch_file, &run);
+    QueryPerformanceCounter(&t1);
+    
+    for (int i = 0; i < file_count; i++) {
+        BatchFile *f = &run.files[i];
+        if (f->failed) {
+            printf("%s: error - %s\n", f->filename, f->status);
+            failed++;
+        } else if (f->modified) {
+            printf("%s: changed, %d -> %d lines, %.1f ms%s%s\n", f->filename,
+                   f->lines_before, f->lines_after, f->ms, f->status[0] ? " - " : "", f->status);
+            changed++;
+        } else {
+            printf("%s: unchanged, %d lines, %.1f ms%s%s\n", f->filename, f->lines_before, f->ms,
+                   f->status[0] ? " - " : "", f->status);
+        }
+    }
+    printf("%d files, %d changed, %d failed in %.1f ms\n", file_count, changed, failed,
+           (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart);
+    
+    free(run.keys);
+    free(run.files);
+    return failed ? 1 : 0;
 }
 
 // Main program
 int main(int argc, char *argv[]) {
     Editor editor;
     
+    // Batch mode: wordstar -x script file...
+    if (argc > 1 && strcmp(argv[1], "-x") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s -x script file...\n", argv[0]);
+            return 2;
+        }
+        return run_batch(argv[2], argc - 3, &argv[3]);
+    }
+    
     init_editor(&editor);
     
-    // Load file if specified
+    // Options: -r fps caps redraws (0 for no cap); -c MB compresses text
+    // unused for a while, and more as needed to stay within MB; -v pages
+    // files from disk read-only, as files over 2 GB always are; -f follows
+    // the files as they grow
+    int follow = 0;
+    while (argc > 1 && (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "-f") == 0 ||
+                        (argc > 2 && (strcmp(argv[1], "-r") == 0 || strcmp(argv[1], "-c") == 0)))) {
+        if (argv[1][1] == 'v' || argv[1][1] == 'f') {
+            if (argv[1][1] == 'v') editor.view_files = 1;
+            else follow = 1;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argv[1][1] == 'r') {
+            int rate = atoi(argv[2]);
+            editor.frame_ms = rate > 0 ? 1000 / rate : 0;
+        } else {
+            editor.cold_budget = atoll(argv[2]) * 1024 * 1024;
+            if (editor.cold_budget <= 0) editor.cold_budget = 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    
+    init_console(&editor);
+    
+    // Load files if specified, each into its own buffer
     if (argc > 1) {
         load_file(&editor, argv[1]);
+        for (int i = 2; i < argc; i++) {
+            open_buffer(&editor, argv[i]);
+        }
+        for (int i = 0; follow && i < editor.doc_count; i++) {
+            set_follow(editor.docs[i], can_follow(editor.docs[i]));
+        }
+        switch_buffer(&editor, 0);
     } else {
         update_status(&editor, "New file - Press ^J for help");
     }
     
-    // Main loop
+    // Main loop: apply all queued input, then redraw once. While input
+    // keeps arriving, redraw at most once per frame.
     draw_screen(&editor);
+    DWORD last_draw = GetTickCount();
+    DWORD last_cool = last_draw;
+    DWORD last_follow = last_draw;
+    DWORD last_check = last_draw;
+    int dirty = 0;
+    int cooling = 0;
+    int indexing = views_scanning(&editor);
     
     while (1) {
-        INPUT_RECORD input;
-        DWORD events;
+        INPUT_RECORD inputs[INPUT_BATCH];
+        DWORD events, wait = INFINITE;
         
-        if (ReadConsoleInput(editor.hConsoleIn, &input, 1, &events)) {
-            if (input.EventType == KEY_EVENT) {
-                process_key(&editor, &input.Event.KeyEvent);
-                
-                // Adjust scroll position
-                int visible_lines = EDIT_END - EDIT_START + 1;
-                int current_line = 0;
-                Line *line = editor.doc.first_line;
-                while (line && line != editor.doc.current_line) {
-                    line = line->next;
-                    current_line++;
-                }
-                
-                if (current_line < editor.top_line) {
-                    editor.top_line = current_line;
-                } else if (current_line >= editor.top_line + visible_lines) {
-                    editor.top_line = current_line - visible_lines + 1;
-                }
-                
-                // Adjust horizontal scroll
-                if (editor.doc.cursor_x < editor.screen_col) {
-                    editor.screen_col = editor.doc.cursor_x;
-                } else if (editor.doc.cursor_x >= editor.screen_col + SCREEN_WIDTH) {
-                    editor.screen_col = editor.doc.cursor_x - SCREEN_WIDTH + 1;
-                }
-                
-                draw_screen(&editor);
-            } else if (input.EventType == WINDOW_BUFFER_SIZE_EVENT) {
-                // Handle window resize if needed
+        if (editor.saving && finish_saves(&editor)) dirty = 1;
+        
+        // Show when paged files are done indexing, making a jump that
+        // waited for it
+        if (view_jump(&editor)) {
+            scroll_to_cursor(&editor);
+            dirty = 1;
+        }
+        if (indexing && (indexing = views_scanning(&editor)) == 0) dirty = 1;
+        
+        // Take in what followed files have grown by
+        if (GetTickCount() - last_follow >= FOLLOW_POLL_MS) {
+            if (follow_files(&editor)) dirty = 1;
+            last_follow = GetTickCount();
+        }
+        
+        // Notice the file being edited changing on disk
+        if (GetTickCount() - last_check >= DISK_CHECK_MS) {
+            if (check_disk(&editor)) dirty = 1;
+            last_check = GetTickCount();
+        }
+        
+        // Compress unused text while idle
+        if (editor.cold_budget && !dirty &&
+            GetTickCount() - last_cool >= (cooling ? COLD_SLICE_MS : COLD_PASS_MS)) {
+            cooling = cool_documents(&editor);
+            last_cool = GetTickCount();
+        }
+        
+        if (dirty) {
+            DWORD pending, since = GetTickCount() - last_draw;
+            GetNumberOfConsoleInputEvents(editor.hConsoleIn, &pending);
+            
+            if (since >= editor.frame_ms && (pending == 0 || editor.frame_ms)) {
                 draw_screen(&editor);
+                last_draw = GetTickCount();
+                dirty = 0;
+                continue;
+            }
+            wait = since >= editor.frame_ms ? 0 : editor.frame_ms - since;
+        }
+        
+        // Time out when the frame is due, or to check on saves
+        if ((editor.saving || indexing) && wait > SAVE_POLL_MS) wait = SAVE_POLL_MS;
+        if (editor.cold_budget && wait > (cooling ? COLD_SLICE_MS : COLD_PASS_MS)) {
+            wait = cooling ? COLD_SLICE_MS : COLD_PASS_MS;
+        }
+        if (files_followed(&editor) && wait > FOLLOW_POLL_MS) wait = FOLLOW_POLL_MS;
+        if (wait > DISK_CHECK_MS) wait = DISK_CHECK_MS;
+        
+        // Wait on the console and the folders of followed files
+        HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+        handles[0] = editor.hConsoleIn;
+        DWORD count = 1 + follow_handles(&editor, &handles[1], MAXIMUM_WAIT_OBJECTS - 1);
+        DWORD woke = WaitForMultipleObjects(count, handles, FALSE, wait);
+        if (woke > WAIT_OBJECT_0 && woke < WAIT_OBJECT_0 + count) {
+            FindNextChangeNotification(handles[woke - WAIT_OBJECT_0]);
+            if (follow_files(&editor)) dirty = 1;
+            last_follow = GetTickCount();
+            continue;
+        }
+        if (woke != WAIT_OBJECT_0) continue;
+        
+        if (ReadConsoleInputW(editor.hConsoleIn, inputs, INPUT_BATCH, &events)) {
+            for (DWORD i = 0; i < events; i++) {
+                int pasted = paste_burst(&editor, &inputs[i], events - i);
+                if (pasted) {
+                    i += pasted - 1;
+                    scroll_to_cursor(&editor);
+                    dirty = 1;
+                } else if (inputs[i].EventType == KEY_EVENT) {
+                    process_key(&editor, &inputs[i].Event.KeyEvent);
+                    scroll_to_cursor(&editor);
+                    dirty = 1;
+                } else if (inputs[i].EventType == WINDOW_BUFFER_SIZE_EVENT) {
+                    // The console may have reflowed or cleared the rows
+                    forget_rows(&editor);
+                    dirty = 1;
+                }
             }
+            commit_journals(&editor);
+            indexing = views_scanning(&editor);
         }
     }
     